@@ -5,71 +5,7 @@
 #include <sys/types.h>
 #include <regex.h>
 
-#define AWK_OK                  0
-#define AWK_CONTINUE            1
-#define AWK_BREAK               2
-#define AWK_FIELD_OUTOFRANGE    3
-#define AWK_LINE_OUTOFRANGE     4
-#define AWK_OPEN_FAILED         5
-#define AWK_REGCOMP             -1
-#define AWK_UNMATCH             -2
-
-/*
- * BSD license.
- *
- * awk related paramters are put in struct awk_st, see the defination. put your private data next to struct awk_st and pack them as the paramter of awk.
- * fun_begin, fun_line and fun_end are the function for when begin , every line and end. if they are unused pass NULL to the function.
- * data->data are user defined type for private use inside the functions, change the type to what it is in the functions.
- * pattern_num must be set and when multipattern the first match is used. if match all, use "". 
- * pattern and action should be in pairs, if no pattern, pattern_default or pattern[0] should be set.
- * if fields[0] is set to AWK_FIELD0_USED or delim is an empty string, $0 will be saved in fields[0], otherwise $0 will be an empty string.
- * all unused fields are set to empty by default.
- *
- * fun_end return none value, while the fun_begin and fun_line
- * return AWK_CONTINUE to continue, return AWK_BREAK to stop excution.
- * fun_end is always excuted even when meets AWK_BREAK.
- *
- * if success awk return AWK_OK, otherwise an errno that can be reported by awk_errno is returned.
- *
- * the temporary fields and line will be unavaliable if they are in an stack and when the stack is unavaliable.
- * modify line and fields to satify your use, an example is appended to the code.
- *
- * Note: the return value that the caller wanted should be stored in data.
- *       what fun_begin and func_line return are just for awk, and what awk return is only used for reporting awk errors.
- *
- * some replace function for string are provided, see the definations.
- *
- */
-
-typedef int (*awk_begin_t)(void *data);
-typedef int (*awk_action_t)(int row_idx, char *fields[], int num_of_fields, void *data);
-typedef void (*awk_end_t)(int row_idx, char *fields[], int num_of_fields, void *data);
-struct awk_st
-{
-#define PATTERN_NUM 3
-#define PATTERN_SIZE 16
-    int pattern_num;
-    char pattern[PATTERN_NUM][PATTERN_SIZE];
-    awk_begin_t fun_begin;
-    awk_end_t fun_end;
-    char action_default[0];
-    awk_action_t actions[PATTERN_NUM];
-    char data[0];
-};
-
-#define AWK_FIELD0_USED (void*)-1
-int awk_(const char *filename, const char *delim, char line[], int linesize, char *fields[], int fieldnum, struct awk_st *_data);
-    /* modify it before use */
-int awk(const char *filename, const char *delim, struct awk_st *_data);
-const char *awk_error(int err);
-
-/* not found also return 0 */
-int awk_str_replace_inplace(char *src, const char *old, const char *new);
-int awk_str_replace(const char *src, const char *old, const char *new, char buf[], int bufsize);
-int awk_str_replace_regex(const char *src, const char *pattern, const char *new, char buf[], int bufsize);
-int awk_str_replace_regex_inplace(char *src, const char *pattern, const char *new);
-
-
+#include "simulate_awk_in_c.h"
 
 const char *awk_error(int err)
 {
@@ -229,7 +165,93 @@ int awk_match(struct awk_st *data, const char *line)
     }
     return AWK_UNMATCH;
 }
+/* the same as awk_match with the patterns compiled, an empty one is not compiled */
+static int awk_match_compiled(struct awk_st *data, regex_t pregs[], const char *line)
+{
+    int i;
+    regmatch_t  pmatch[1];
+
+    if(data->pattern_num == 0)
+        return 0;
+    for (i = 0; i < data->pattern_num; ++i) {
+        if(data->pattern[i][0] == 0)
+            return i;
+        if(regexec(&pregs[i], line, 1, pmatch, 0) == 0)
+            return i;
+    }
+    return AWK_UNMATCH;
+}
+static int awk_compile(struct awk_st *data, regex_t pregs[])
+{
+    int i, j;
+    for (i = 0; i < data->pattern_num; ++i) {
+        /* the line has its newline, $ matches before it like awk */
+        if(data->pattern[i][0] != 0 && regcomp(&pregs[i], data->pattern[i], REG_EXTENDED|REG_NEWLINE) != 0)
+        {
+            for (j = 0; j < i; ++j) {
+                if(data->pattern[j][0] != 0)
+                    regfree(&pregs[j]);
+            }
+            return AWK_REGCOMP;
+        }
+    }
+    return AWK_OK;
+}
+static void awk_free(struct awk_st *data, regex_t pregs[])
+{
+    int i;
+    for (i = 0; i < data->pattern_num; ++i) {
+        if(data->pattern[i][0] != 0)
+            regfree(&pregs[i]);
+    }
+}
+/* the buffer of the lines, of the caller or grown by awk up to max */
+struct awk_line
+{
+    char *buf;
+    size_t size;
+    int max;
+};
+/* read a line, room is kept after it for the copy of $0 if field0.
+   return its length, -1 at the end, -2 if it is too long */
+static int awk_getline(FILE *stream, struct awk_line *l, int field0)
+{
+    if(l->max == 0)     /* of the caller */
+        return fgets(l->buf, l->size, stream) ? (int)strlen(l->buf) : -1;
+
+    ssize_t n = getline(&l->buf, &l->size, stream);
+    if(n < 0)
+        return -1;
+    if(n > l->max)
+        return -2;
+    if(field0 && l->size < 2*n+2)
+    {
+        char *buf = realloc(l->buf, 2*n+2);
+        if(buf == NULL)
+            return -2;
+        l->buf = buf;
+        l->size = 2*n+2;
+    }
+    return n;
+}
+static int awk_lines(FILE *stream, const char *delim, struct awk_line *lb, char *fields[], int fieldnum, struct awk_st *_data, regex_t pregs[]);
 int awk__(FILE *stream, const char *delim, char line[], int linesize, char *fields[], int fieldnum, struct awk_st *_data)
+{
+    regex_t pregs[PATTERN_NUM];
+    struct awk_line lb = {line, line != NULL ? linesize : 0, line != NULL ? 0 : linesize};
+    int ret;
+
+    if(_data->pattern_num > PATTERN_NUM)
+        return AWK_REGCOMP;
+    if((ret = awk_compile(_data, pregs)) != AWK_OK)
+        return ret;
+    ret = awk_lines(stream, delim, &lb, fields, fieldnum, _data, pregs);
+    awk_free(_data, pregs);
+    if(line == NULL)
+        free(lb.buf);
+    return ret;
+}
+static int awk_lines(FILE *stream, const char *delim, struct awk_line *lb, char *fields[], int fieldnum, struct awk_st *_data, regex_t pregs[])
 {
 #define ADD_FIELD(found) \
         if(found)\
@@ -243,11 +265,13 @@ int awk__(FILE *stream, const char *delim, char line[], int linesize, char *fiel
     awk_begin_t fun_begin = _data->fun_begin;
     awk_end_t fun_end = _data->fun_end;
     awk_action_t *actions = _data->actions;
+    int field_rest = _data->field_rest;
     void *data = _data->data;
     
 
     int row_idx = 0;
-    int i, field_idx, found, field0_used;
+    int i, n, field_idx, found, field0_used;
+    char *line;
 
     if(fieldnum < 1)                    /* at least one field */
         return AWK_FIELD_OUTOFRANGE;
@@ -268,21 +292,25 @@ int awk__(FILE *stream, const char *delim, char line[], int linesize, char *fiel
         fields[i] = empty;
     }
     errno = 0;
-    while(fgets(line, linesize, stream) || errno == EINTR)
+    while((n = awk_getline(stream, lb, field0_used && *delim)) != -1 || errno == EINTR)
     {
         int act_idx;
-        if((act_idx=awk_match(_data, line)) < 0)
+        if(n == -1)     /* EINTR */
+        {
+            errno = 0;
+            clearerr(stream);
+            continue;
+        }
+        if(n == -2)
+            return AWK_LINE_OUTOFRANGE;
+        line = lb->buf;     /* it may be moved by getline */
+        if((act_idx=awk_match_compiled(_data, pregs, line)) < 0)
         {
             if(act_idx == AWK_UNMATCH)
                 continue;
             return act_idx;     /* error number */
         }
         awk_action_t fun_action = actions[act_idx];
-        if(errno == EINTR)
-        {
-            errno = 0;
-            continue;
-        }
 
         for (i = 0; i < fieldnum; ++i) {
             static char *empty="";
@@ -293,23 +321,22 @@ int awk__(FILE *stream, const char *delim, char line[], int linesize, char *fiel
         {
             if(field0_used)
             {
-                int l = strlen(line);
-                if((l*2) > linesize-2)
+                if((n*2) > (int)lb->size-2)
                     return AWK_LINE_OUTOFRANGE;
-                fields[0] = &line[l+1];
+                fields[0] = &line[n+1];
                 strcpy(fields[0], &line[0]);
             }
-            for(i = 0,found=1; i < linesize
+            for(i = 0,found=1; i < lb->size
                     && line[i] != '\n' && line[i] != 0; i++)
             {
                 ADD_FIELD(found);
-                if(strchr(delim, line[i]))
+                if((field_idx < fieldnum || !field_rest) && strchr(delim, line[i]))
                 {
                     line[i] = 0;
                     found = 1;
                 }
             }
-            if(i == linesize)
+            if(i == lb->size)
                 return AWK_LINE_OUTOFRANGE;
             line[i] = 0; // if '\n', -> '\0'
             ADD_FIELD(found);
@@ -428,6 +455,7 @@ int func_action(int row_idx, char *fields[], int num_of_fields, void *data)
     return AWK_CONTINUE;
 }
 
+#ifndef AWK_NO_MAIN     /* built as a library, like cc -DAWK_NO_MAIN -c simulate_awk_in_c.c */
 void example(void)
 {
     struct buf_all
@@ -456,5 +484,4 @@ int main(void)
     example();
     return 0;
 }
-
-
+#endif
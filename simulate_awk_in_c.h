@@ -0,0 +1,75 @@
+#ifndef SIMULATE_AWK_IN_C_H
+#define SIMULATE_AWK_IN_C_H
+#include <stdio.h>
+
+#define AWK_OK                  0
+#define AWK_CONTINUE            1
+#define AWK_BREAK               2
+#define AWK_FIELD_OUTOFRANGE    3
+#define AWK_LINE_OUTOFRANGE     4
+#define AWK_OPEN_FAILED         5
+#define AWK_REGCOMP             -1
+#define AWK_UNMATCH             -2
+
+/*
+ * BSD license.
+ *
+ * awk related paramters are put in struct awk_st, see the defination. put your private data next to struct awk_st and pack them as the paramter of awk.
+ * fun_begin, fun_line and fun_end are the function for when begin , every line and end. if they are unused pass NULL to the function.
+ * data->data are user defined type for private use inside the functions, change the type to what it is in the functions.
+ * pattern_num must be set and when multipattern the first match is used. if match all, use "". 
+ * pattern and action should be in pairs, if no pattern, pattern_default or pattern[0] should be set.
+ * if fields[0] is set to AWK_FIELD0_USED or delim is an empty string, $0 will be saved in fields[0], otherwise $0 will be an empty string.
+ * all unused fields are set to empty by default.
+ * a line with more than fieldnum fields fails with AWK_FIELD_OUTOFRANGE unless field_rest is set.
+ *
+ * fun_end return none value, while the fun_begin and fun_line
+ * return AWK_CONTINUE to continue, return AWK_BREAK to stop excution.
+ * fun_end is always excuted even when meets AWK_BREAK.
+ *
+ * if success awk return AWK_OK, otherwise an errno that can be reported by awk_errno is returned.
+ *
+ * the temporary fields and line will be unavaliable if they are in an stack and when the stack is unavaliable.
+ * modify line and fields to satify your use, an example is appended to the code.
+ *
+ * Note: the return value that the caller wanted should be stored in data.
+ *       what fun_begin and func_line return are just for awk, and what awk return is only used for reporting awk errors.
+ *
+ * some replace function for string are provided, see the definations.
+ *
+ */
+
+typedef int (*awk_begin_t)(void *data);
+typedef int (*awk_action_t)(int row_idx, char *fields[], int num_of_fields, void *data);
+typedef void (*awk_end_t)(int row_idx, char *fields[], int num_of_fields, void *data);
+struct awk_st
+{
+#define PATTERN_NUM 3
+#define PATTERN_SIZE 256
+    int pattern_num;
+    char pattern[PATTERN_NUM][PATTERN_SIZE];
+    awk_begin_t fun_begin;
+    awk_end_t fun_end;
+    int field_rest;     /* not 0, the rest of a line over fieldnum fields is left in the last field */
+    char action_default[0];
+    awk_action_t actions[PATTERN_NUM];
+    char data[0];
+};
+
+#define AWK_FIELD0_USED (void*)-1
+int awk_(const char *filename, const char *delim, char line[], int linesize, char *fields[], int fieldnum, struct awk_st *_data);
+    /* the same on a stream, the patterns are compiled once for all lines.
+       line may be NULL, then a line is read whole into a buffer of awk, it
+       fails with AWK_LINE_OUTOFRANGE if one is over linesize chars */
+int awk__(FILE *stream, const char *delim, char line[], int linesize, char *fields[], int fieldnum, struct awk_st *_data);
+    /* modify it before use */
+int awk(const char *filename, const char *delim, struct awk_st *_data);
+const char *awk_error(int err);
+int awk_match(struct awk_st *data, const char *line);
+
+/* not found also return 0 */
+int awk_str_replace_inplace(char *src, const char *old, const char *new);
+int awk_str_replace(const char *src, const char *old, const char *new, char buf[], int bufsize);
+int awk_str_replace_regex(const char *src, const char *pattern, const char *new, char buf[], int bufsize);
+int awk_str_replace_regex_inplace(char *src, const char *pattern, const char *new);
+#endif
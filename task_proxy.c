@@ -1,6 +1,8 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <sys/wait.h>
 #include <sys/signalfd.h>
+#include <sys/timerfd.h>
 #include <signal.h>
 #include <unistd.h>
 #include <stdlib.h>
@@ -10,23 +12,89 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/uio.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <stdint.h>
+#include <time.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#include <stdarg.h>
+#include "simulate_awk_in_c.h"
 
 #define REQUESTBUF_SIZE 5100
 #define SOCK_PATH  "/tmp/task_proxy"
-#define MAX_TASKS  16
+#ifndef MAX_TASKS
+#define MAX_TASKS  16       /* slots of a reactor, also the number of request buffers */
+#endif
+#define CACHELINE  64
 #define BACKLOG    32
-#define MAX_EVENTS 2+MAX_TASKS
+#define MAX_EVENTS (4+3*MAX_TASKS)  /* a task may have a socket and two stream pipes */
+#define REACTOR_MAX 32
+#define SPAWN_MAX  (REACTOR_MAX*MAX_TASKS)
+#define CHILD_MAX  (SPAWN_MAX*STAGE_MAX)   /* a task of a pipeline has STAGE_MAX children */
 
 #define ARGV_MAX 16
+#define STAGE_MAX 8     /* of a pipeline */
+#define FILTER_LINE_MAX (1<<20)    /* a line is read whole, a longer one stops the filter */
+#define FILTER_FIELDS 256   /* the columns are below it, the fields past them are not split */
+#define FILTER_COLS 16
+
+#define POOL_LIMIT      64      /* upper bound of -p */
+#define POOL_DEFAULT    4       /* helpers kept at most by default */
+#define POOL_PERIOD_MS  100     /* the pool is resized to the requests seen in a period */
+#define POOL_EWMA       4       /* weight of the history in the average rate */
+#define POOL_REFILL     2       /* helpers forked at most per loop, to not stall the loop */
+
+#define EXE_CACHE_SIZE  64      /* resolved executables kept open */
+#define EXE_PROBE       4
+#define EXE_NAME_MAX    64
+#define ALLOW_MAX       128
+#define DEFAULT_PATH    "/usr/local/bin:/usr/bin:/bin"
+
+#ifndef URING_DEFAULT
+#define URING_DEFAULT   0       /* build with -DURING_DEFAULT=1 to use io_uring without -u */
+#endif
+#define RING_ENTRIES    128
+#define REPLY_MAX       (2*MAX_TASKS)
+
+#define CACHE_DEFAULT_MB 16     /* the output cached at most, -m */
+#define CACHE_ENTRY_MAX (1<<20)
+#define CACHE_BUCKETS   1024
+
+#define CGROUP_PATH_MAX 256
+#define CGROUP_LIMIT_MAX 16
 
 
 /*
  * BSD License
+ * build: cc -O2 -pthread -DAWK_NO_MAIN -o task_proxy task_proxy.c simulate_awk_in_c.c
  * request must start with CMD, end with \0, parameters separated with DELIM
  * NRET means return immediately, excute background
  * PIPE means receive the output of the task
  * EXEC means receive a return status like that in waitpid
+ * STRM means receive stdout, stderr and the status as frames, see below
+ * options may follow CMD before the first DELIM, separated with ','
+ *   r      also send the rusage of the task (EXEC and STRM only)
+ *   t=ms   deadline of the task, SIGTERM then SIGKILL after KILL_GRACE_MS,
+ *          0 for none, -t of the proxy by default. the status returned has
+ *          TASK_TIMEDOUT set if it is killed so
+ *   p=n    priority class, 0 interactive, 1 normal, 2 batch. NRET is 2 and
+ *          the others are 0 by default
+ *   c=ms   the result may be taken from the cache for ms (EXEC and PIPE, not
+ *          with r). the key is a hash of argv, the files it names (the
+ *          executable and the arguments with a '/') by mtime, size and inode,
+ *          and the cwd and the environment of the proxy. a task exited by
+ *          itself and not killed is cached, its output of PIPE too if it is
+ *          not over CACHE_ENTRY_MAX. a hit is replied without a task
+ * requests wait in a queue if the classes are busy, the classes are served
+ * by deficit round robin and the clients (uid) in a class by round robin
  * don't use spaces unless you know what you are doing
  * for example:
  * "exec#ls#-l#/tmp" \0 is contained
@@ -35,77 +103,506 @@
  * if a status is returned it is put after RETURN_MARK
  * for example:
  * "####\x0\x0\x0\x0"
+ * with r the status of EXEC is followed by a struct task_rusage. the status
+ * has TASK_OOMKILLED set if the OOM killer killed something of the task in its
+ * cgroup, see -g
+ *
+ * a STRM reply is a sequence of frames, a frame is a tag byte, an int32 length
+ * and the payload. data is moved from the pipes of the task to the client by
+ * splice, so it is not copied into the proxy but what is left at the exit.
+ * a client slow to read only slows its task, the output waits in the pipes:
+ * "o" len data         some stdout of the task
+ * "e" len data         some stderr of the task
+ * "r" len rusage       struct task_rusage, only if r is set
+ * "s" 4 status         always the last frame, the status like that in waitpid
+ * for example:
+ * "strm,r#ls#-l#/tmp" \0 is contained
+ *
+ * "stat" \0 is contained, returns the counters and the latencies of the proxy
+ * as text, "stat,j" as JSON. it is answered by the proxy, nothing is run
+ *
+ * BTCH runs many commands like EXEC, one per line, in one request:
+ * "btch,n=4#ls#/tmp\n#ls#/usr" \0 is contained
+ *   n=N    N items running at most at once, as many as the slots allow if not set
+ * each item takes a slot of the reactor when its class is free to run it, it
+ * waits behind the queued requests of the class, in class 1 by default. a slot is kept from new clients for a batch
+ * with no item running, so it always goes on. a reactor has BATCH_MAX batches
+ * at most, a BTCH over it is closed at once. the reply is frames like STRM:
+ * "i" 8 index status   an item is done, in the order they are done. status is
+ *                      -1 if it is not run. with r a struct task_rusage follows
+ * "s" 8 items failed   the last frame, failed counts the status not 0
+ *
+ * PPLN runs a pipeline, the lines are its stages, stdout of a stage is piped to
+ * stdin of the next. the stages are in a process group, a timeout kills it all
+ * "ppln,o#ls#/usr/bin\n#grep#gcc\n#wc#-l" \0 is contained
+ *   o      stdout of the last stage is sent to the client like PIPE
+ * it is replied like EXEC with the status of each stage, after the output:
+ * "####" int32 stages, int32 status of each stage, -1 if it is not run
+ *
+ * PIPE may have a filter on a second line, the output is sent through it:
+ * "pipe#cat#/etc/passwd\n#filter#:#1,7#^root#bash$" \0 is contained
+ * filter#delim#columns#pattern... is a builtin, it keeps the lines matching one
+ * of the patterns (extended regex, all lines if none) and prints the columns,
+ * split by any char of delim and joined by a space, 0 for the whole line like
+ * awk. PATTERN_NUM patterns of PATTERN_SIZE-1 chars at most, lines of
+ * FILTER_LINE_MAX chars at most. it runs the awk engine of simulate_awk_in_c.c
+ * and can be a stage of PPLN too. if it fails, a line of "filter: " and the
+ * error is the last of the output, as there is no status
  **/
 #define CMDLEN 4
 #define EXEC "exec"
 #define PIPE "pipe"
 #define NRET "nret"
+#define STRM "strm"
+#define STAT "stat"
+#define BTCH "btch"
+#define PPLN "ppln"
 enum
 {
     EXECID,
     PIPEID,
     NRETID,
+    STRMID,
+    STATID,
+    BTCHID,
+    PPLNID,
+    TYPE_NUM,
+};
+
+#define OPT_DELIM ','
+#define OPT_RUSAGE  0x1
+#define OPT_JSON    0x2
+#define OPT_OUTPUT  0x4
+#define OPT_NOSTATUS 0x8    /* of a PPLN made of a PIPE with a filter */
+struct taskopt
+{
+    int flags;
+    int timeout_ms;     /* -1 if not set */
+    int prio;           /* -1 if not set */
+    int limit;          /* n= of BTCH, -1 if not set */
+    int cache_ms;       /* c=, 0 if not cached */
+};
+
+#define KILL_GRACE_MS   2000
+#define TASK_TIMEDOUT   0x10000     /* or-ed to the status, not used by waitpid */
+#define TASK_OOMKILLED  0x20000
+
+enum
+{
+    CLASS_INTERACTIVE,
+    CLASS_NORMAL,
+    CLASS_BATCH,
+    CLASS_NUM,
+};
+#define PENDING_MAX 1024        /* of a reactor, more requests are refused */
+#define FLOW_MAX PENDING_MAX    /* a pending request has one flow at most */
+enum
+{
+    SCHED_NONE,
+    SCHED_RUNNING,
+};
+
+#define FRAME_STDOUT 'o'
+#define FRAME_STDERR 'e'
+#define FRAME_RUSAGE 'r'
+#define FRAME_STATUS 's'
+#define FRAME_ITEM   'i'
+#define FRAME_HEADER (1+sizeof(int32_t))
+#define FRAME_MAX   65536       /* the default capacity of a pipe */
+
+struct task_rusage
+{
+    int64_t utime_us;
+    int64_t stime_us;
+    int64_t maxrss_kb;
+    int64_t minflt;
+    int64_t majflt;
+    int64_t inblock;
+    int64_t oublock;
+    int64_t nvcsw;
+    int64_t nivcsw;
 };
 
+/* what an epoll event belongs to, saved in ev.data.fd as -(kind*MAX_TASKS+i) */
+enum
+{
+    EV_CLIENT,
+    EV_STDOUT,
+    EV_STDERR,
+    EV_OUTPUT,  /* the client socket is writable, see out_flush */
+};
+#define ev_encode(kind, i)  (-((kind)*MAX_TASKS+(i)))
+
+#define BATCH_RESERVE   1       /* slots left by the items of batches for new clients */
+#define BATCH_MAX       (MAX_TASKS/4)   /* batches of a reactor, more are closed at once */
+#define TASK_NOT_RUN    -1      /* the status of an item or a stage not run */
+
 #define DELIM '#'
 #define RETURN_MARK "####"
 
 #define error_exist(msg ) do { perror(msg); exit(EXIT_FAILURE); } while (0)
 
+/* a request buffer, one per slot, taken from a slab made at startup */
 struct taskbuf
 {
     int len;
     char buf[REQUESTBUF_SIZE];
-};
+} __attribute__((aligned(CACHELINE)));
 /* pid is positive, use negtive num to represent a free list */
-int pid_count, task_count;
-pid_t task_pids[MAX_TASKS];
-int   task_socks[MAX_TASKS];
-void *task_buf[MAX_TASKS];
-int avaliable_list;
+/* the slots and everything below are of a reactor, each has its own */
+__thread int pid_count, task_count;
+__thread pid_t task_pids[MAX_TASKS];
+__thread int   task_socks[MAX_TASKS];
+__thread int   task_types[MAX_TASKS];
+__thread struct taskopt task_opts[MAX_TASKS];
+__thread int   task_pipes[MAX_TASKS][2];     /* read ends of stdout and stderr of STRM */
+__thread struct taskbuf *task_bufs;    /* MAX_TASKS of them, never freed */
+
+/* what the client can't take yet, sent when the socket is writable by
+   out_flush. the socket is never blocking, a slow client stalls nobody */
+struct outq
+{
+    char *buf;
+    int off, len, size;
+    struct cache_entry *entry;  /* buf is the output of a cache entry replied, not ours */
+};
+__thread struct outq task_outq[MAX_TASKS];
+__thread int task_splice[MAX_TASKS];        /* the payload of a STRM frame left in a pipe */
+__thread int task_splice_pipe[MAX_TASKS];
+__thread int task_outwatch[MAX_TASKS];      /* EPOLLOUT of the socket is watched */
+__thread int task_pipewatch[MAX_TASKS];     /* the pipes are watched, not while the client is full */
+__thread int task_draining[MAX_TASKS];      /* done, the slot is put when the queue is sent */
+__thread int avaliable_list;
+
+/* a batch keeps the client in its slot, its items run in other slots */
+struct batch
+{
+    int total;          /* items, -1 if the slot is not a batch */
+    int pos;            /* where the next item is in the buffer of the slot */
+    int started, done, failed;
+    int broken;         /* the client is gone, start no more */
+};
+__thread struct batch batches[MAX_TASKS];
+__thread int batch_num;
+__thread int batch_parent[MAX_TASKS];       /* of an item, the slot of its batch, -1 if not an item */
+__thread int batch_index[MAX_TASKS];
+__thread int ppln_num[MAX_TASKS], ppln_left[MAX_TASKS];     /* stages, not exited yet */
+__thread int32_t ppln_status[MAX_TASKS][STAGE_MAX];
+
+/* the output of a PIPE to be cached, taken from task_pipes[i][0] */
+struct capture
+{
+    char *buf;
+    int len;            /* -1 if too large to be cached */
+    int size;
+};
+__thread struct capture task_captures[MAX_TASKS];
+__thread uint64_t task_cache_key[MAX_TASKS];
+
+/* tasks with a deadline, a min heap ordered by task_deadline */
+__thread int heap_num;
+__thread int heap[MAX_TASKS];
+__thread int task_heapidx[MAX_TASKS];        /* -1 if not in the heap */
+__thread long long task_deadline[MAX_TASKS];
+__thread int task_timedout[MAX_TASKS];       /* 1 after SIGTERM, 2 after SIGKILL */
+__thread int timer_fd;
+__thread long long timer_armed;
+int default_timeout_ms;
+
+/*
+ * pending tasks are queued per flow, a flow is the tasks of a client in a
+ * class. the flows of a class are in a ring and served in turn, the classes
+ * are served by deficit round robin with class_quantum, each task costs 1.
+ * the caps are of a reactor. a pending request leaves its slot, it is kept
+ * in a struct pending until it runs, so a long queue of one class never
+ * takes the slots from the requests of the others.
+ */
+int class_quantum[CLASS_NUM] = {8, 4, 1};
+int class_cap[CLASS_NUM] = {MAX_TASKS, MAX_TASKS, MAX_TASKS/2};
+int run_max = MAX_TASKS;
+__thread int class_running[CLASS_NUM];
+__thread int class_pending[CLASS_NUM];
+__thread int class_deficit[CLASS_NUM];
+__thread int class_flow[CLASS_NUM];          /* the flow to serve next, -1 if none */
+__thread int sched_class;
+__thread int run_num;
+
+struct pending
+{
+    struct pending *next;   /* in the flow */
+    int sock;
+    int type;
+    int cls;
+    int stages;             /* of a pipeline */
+    uid_t uid;
+    struct taskopt opt;
+    uint64_t cache_key;
+    long long t_accept, t_request;
+    int len;
+    char buf[];
+};
+__thread int pending_num;
+
+__thread uid_t flow_uid[FLOW_MAX];
+__thread struct pending *flow_head[FLOW_MAX], *flow_tail[FLOW_MAX];
+__thread int flow_next[FLOW_MAX];            /* in the ring of a class or the free list */
+__thread int flow_free;
+
+__thread uid_t task_uid[MAX_TASKS];
+__thread int task_class[MAX_TASKS];
+__thread int task_state[MAX_TASKS];
+
+__thread int epollfd;
+__thread int reactor_id;
+__thread int listen_paused;     /* the listen socket is out of the epoll, no free slot */
+int use_uring = URING_DEFAULT;
+
+/*
+ * the proxy runs -r reactors and a spawner. a reactor accepts and reads the
+ * requests, queues them and replies, on its own epoll with its own slots.
+ * the spawner is the main thread, it forks or hands a request to the pool
+ * and reaps the children, so a slow fork never stalls a reactor.
+ * they talk by fixed size messages on pipes, which are written atomically.
+ * the signals of the deadlines are sent by the spawner too, it knows whether
+ * the child is reaped, so a pid used again is never signaled.
+ */
+struct spawn_req
+{
+    int reactor;
+    int i;
+    int type;
+    int cl;
+    int wr[2];          /* closed by the spawner */
+    char *buf;          /* the slot buffer of the reactor, kept until the reply */
+    int len;
+    int cls;            /* the class, for the cgroup */
+    int flags;          /* of struct taskopt */
+    long long t_request;    /* now_us() the request was complete */
+    int sig;            /* not 0, a kill of the task of i instead, see spawner_kill */
+    pid_t pid;          /* of the kill, the group of PPLN */
+};
+enum
+{
+    SPAWN_OK,
+    SPAWN_FAILED,
+    SPAWN_EXITED,
+};
+struct spawn_ev
+{
+    int what;
+    int i;
+    pid_t pid;
+    int status;         /* of SPAWN_OK of PPLN, the stages started */
+    int stage;          /* of SPAWN_EXITED of PPLN, -1 if not */
+    struct rusage ru;
+};
+int reactor_num;
+int server_sock;
+int spawner_pipe[2];
+int reactor_pipes[REACTOR_MAX][2];
+pid_t spawn_pids[CHILD_MAX];        /* the children of reactors, of the spawner only */
+int   spawn_owner[CHILD_MAX];       /* reactor*MAX_TASKS+i */
+int   spawn_leaf[CHILD_MAX];        /* the cgroup of the child, -1 if none */
+int   spawn_stage[CHILD_MAX];       /* of a pipeline, -1 if not */
+
+/*
+ * metrics, counted by all threads with relaxed atomics and read by STAT.
+ * latencies are in us, in log-linear histograms of HIST_SUB buckets for
+ * each power of 2, so a percentile is off by 1/HIST_SUB at most
+ */
+#define HIST_SUB_BITS   3
+#define HIST_SUB        (1<<HIST_SUB_BITS)
+#define HIST_MAX_BITS   40      /* about 12 days */
+#define HIST_BUCKETS    ((HIST_MAX_BITS-HIST_SUB_BITS+1)*HIST_SUB)
+#define STAT_MAX        4096
+enum
+{
+    H_READ,     /* accepted to the request complete */
+    H_SPAWN,    /* the request complete to the fork returned, the time queued is in */
+    H_EXEC,     /* fork to exec */
+    H_RUN,      /* exec to exit */
+    H_NUM,
+};
+const char *hist_names[H_NUM] = {"accept_to_request", "request_to_fork", "fork_to_exec", "exec_to_exit"};
+const char *type_names[TYPE_NUM] = {EXEC, PIPE, NRET, STRM, STAT, BTCH, PPLN};
+struct hist
+{
+    unsigned long long count, sum, max;
+    unsigned long long buckets[HIST_BUCKETS];
+};
+struct metrics
+{
+    unsigned long long accepted;
+    unsigned long long requests[TYPE_NUM];
+    unsigned long long spawned, spawn_failed, exited, timedout, oomkilled;
+    unsigned long long bytes_forwarded;     /* of STRM and PIPE cached, the others are not proxied */
+    unsigned long long cache_hits, cache_misses;
+    long long cache_bytes;
+    long long pending, running;             /* now, of all reactors */
+    struct hist hists[H_NUM];
+} metrics;
+#define metric_add(field, n) __atomic_fetch_add(&metrics.field, (n), __ATOMIC_RELAXED)
+__thread long long task_t_accept[MAX_TASKS], task_t_request[MAX_TASKS];
+long long spawn_t_fork[SPAWN_MAX];      /* of the spawner, by reactor*MAX_TASKS+i */
+long long *exec_marks;      /* the same, shared with the children, set just before exec */
+int child_owner = -1;       /* in a child, the index of exec_marks */
 
-int epollfd;
+long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+int hist_index(unsigned long long v)
+{
+    if(v < HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    if(shift + HIST_SUB_BITS >= HIST_MAX_BITS)
+        return HIST_BUCKETS-1;
+    return (shift+1)*HIST_SUB + (v >> shift) - HIST_SUB;
+}
+/* the largest value of a bucket */
+unsigned long long hist_bound(int k)
+{
+    if(k < HIST_SUB)
+        return k;
+    int shift = k/HIST_SUB - 1;
+    return ((unsigned long long)(HIST_SUB + k%HIST_SUB + 1) << shift) - 1;
+}
+void hist_add(int h, long long v)
+{
+    struct hist *p = &metrics.hists[h];
+    unsigned long long m;
 
-struct taskbuf *task_getbuf(i)
+    if(v < 0)
+        v = 0;
+    __atomic_fetch_add(&p->buckets[hist_index(v)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->sum, v, __ATOMIC_RELAXED);
+    m = __atomic_load_n(&p->max, __ATOMIC_RELAXED);
+    while(v > m && !__atomic_compare_exchange_n(&p->max, &m, v, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+/* q of 1000, like 999 for p99.9. the bound of a bucket may be over what was seen */
+unsigned long long hist_percentile(const unsigned long long buckets[], unsigned long long count,
+        unsigned long long max, int q)
+{
+    unsigned long long rank = count*q/1000, seen = 0;
+    int k;
+    for (k = 0; k < HIST_BUCKETS; ++k) {
+        seen += buckets[k];
+        if(seen > rank)
+            return hist_bound(k) < max ? hist_bound(k) : max;
+    }
+    return 0;
+}
+/* in a child, the time the task starts to run */
+void exec_mark(void)
 {
-    return task_buf[i];
+    if(child_owner >= 0 && exec_marks != NULL)
+        __atomic_store_n(&exec_marks[child_owner], now_us(), __ATOMIC_RELAXED);
 }
-struct taskbuf *task_allocbuf(i)
+int stat_printf(char out[], int size, int n, const char *fmt, ...)
 {
-#ifndef NDEBUG
-    fprintf(stderr, "task alloc\n");
-    if(task_buf[i] != NULL)
-    {
-        fprintf(stderr, "unexpected memory not free\n");
+    va_list ap;
+    if(n >= size)
+        return n;
+    va_start(ap, fmt);
+    n += vsnprintf(out+n, size-n, fmt, ap);
+    va_end(ap);
+    return n < size ? n : size;
+}
+/* a snapshot of the metrics as text or JSON, return the length */
+int metrics_format(char out[], int size, int json)
+{
+    static const int qs[] = {500, 900, 990, 999};
+    static const char *qnames[] = {"p50", "p90", "p99", "p999"};
+    unsigned long long buckets[HIST_BUCKETS];
+    int n = 0, h, k;
+
+#define STAT_VALUE(name, v) \
+    n = stat_printf(out, size, n, json ? "\"%s\":%lld," : "%s %lld\n", name, (long long)__atomic_load_n(&(v), __ATOMIC_RELAXED))
+    n = stat_printf(out, size, n, json ? "{" : "");
+    STAT_VALUE("accepted", metrics.accepted);
+    n = stat_printf(out, size, n, json ? "\"requests\":{" : "requests");
+    for (k = 0; k < TYPE_NUM; ++k) {
+        n = stat_printf(out, size, n, json ? "%s\"%s\":%llu" : "%s %s=%llu", json && k ? "," : "",
+                type_names[k], __atomic_load_n(&metrics.requests[k], __ATOMIC_RELAXED));
     }
-    else
-#endif
-    {
-        task_buf[i] = malloc(REQUESTBUF_SIZE);
+    n = stat_printf(out, size, n, json ? "}," : "\n");
+    STAT_VALUE("spawned", metrics.spawned);
+    STAT_VALUE("spawn_failed", metrics.spawn_failed);
+    STAT_VALUE("exited", metrics.exited);
+    STAT_VALUE("timedout", metrics.timedout);
+    STAT_VALUE("oomkilled", metrics.oomkilled);
+    STAT_VALUE("pending", metrics.pending);
+    STAT_VALUE("running", metrics.running);
+    STAT_VALUE("bytes_forwarded", metrics.bytes_forwarded);
+    STAT_VALUE("cache_hits", metrics.cache_hits);
+    STAT_VALUE("cache_misses", metrics.cache_misses);
+    STAT_VALUE("cache_bytes", metrics.cache_bytes);
+#undef STAT_VALUE
+
+    n = stat_printf(out, size, n, json ? "\"latency_us\":{" : "");
+    for (h = 0; h < H_NUM; ++h) {
+        struct hist *p = &metrics.hists[h];
+        unsigned long long count = 0;
+        for (k = 0; k < HIST_BUCKETS; ++k) {
+            buckets[k] = __atomic_load_n(&p->buckets[k], __ATOMIC_RELAXED);
+            count += buckets[k];
+        }
+        unsigned long long sum = __atomic_load_n(&p->sum, __ATOMIC_RELAXED);
+        unsigned long long max = __atomic_load_n(&p->max, __ATOMIC_RELAXED);
+        n = stat_printf(out, size, n, json ? "%s\"%s\":{\"count\":%llu,\"mean\":%llu"
+                : "%slatency_us %s count=%llu mean=%llu", json && h ? "," : "",
+                hist_names[h], count, count ? sum/count : 0);
+        for (k = 0; k < sizeof qs/sizeof qs[0]; ++k) {
+            n = stat_printf(out, size, n, json ? ",\"%s\":%llu" : " %s=%llu",
+                    qnames[k], hist_percentile(buckets, count, max, qs[k]));
+        }
+        n = stat_printf(out, size, n, json ? ",\"max\":%llu}" : " max=%llu\n", max);
     }
-    return task_buf[i];
+    n = stat_printf(out, size, n, json ? "}}\n" : "");
+    return n;
 }
-void task_freebuf(i)
+
+struct taskbuf *task_getbuf(int i)
 {
-    if(task_buf[i])
-    {
-        free(task_buf[i]);
-        task_buf[i] = NULL;
-    }
+    return &task_bufs[i];
+}
+/* the buffer stays with the slot, only forget what is in it */
+void task_freebuf(int i)
+{
+    task_bufs[i].len = 0;
 }
 
 void task_prepare(void)
 {
     int i;
+    task_bufs = aligned_alloc(CACHELINE, MAX_TASKS*sizeof(struct taskbuf));
+    if(task_bufs == NULL)
+        error_exist("aligned_alloc");
     for (i = 0; i < MAX_TASKS; ++i) {
         task_pids[i] = -i-1;
         task_socks[i] = -1;
-        task_buf[i] = NULL;
+        task_pipes[i][0] = -1;
+        task_pipes[i][1] = -1;
+        task_heapidx[i] = -1;
+        task_bufs[i].len = 0;
+        batches[i].total = -1;
+        batch_parent[i] = -1;
     }
     avaliable_list = 0;
     pid_count = 0;
     task_count = 0;
-    signal(SIGPIPE, SIG_IGN);
+    for (i = 0; i < FLOW_MAX; ++i) {
+        flow_next[i] = i+1;
+    }
+    flow_free = 0;
+    for (i = 0; i < CLASS_NUM; ++i) {
+        class_flow[i] = -1;
+    }
 }
 
 /* to get a free node
@@ -122,33 +619,77 @@ int task_get(void)
     task_count++;
     return i;
 }
+/* let other reactors take the connections while all slots are in use */
+void listen_pause(void)
+{
+    if(use_uring || listen_paused)
+        return;
+    if(epoll_ctl(epollfd, EPOLL_CTL_DEL, server_sock, NULL) == -1)
+        perror("listen_pause epoll_ctl");
+    listen_paused = 1;
+}
+void listen_resume(void)
+{
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLEXCLUSIVE;   /* can't be modified, add it again */
+    ev.data.fd = server_sock;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, server_sock, &ev) == -1)
+        perror("listen_resume epoll_ctl");
+    listen_paused = 0;
+}
+void stream_close(int i);
+void out_reset(int i);
+void timer_del(int i);
+void batch_item_done(int k, int status, const struct rusage *ru);
+/* a running task leaves the caps */
+void sched_done(int i)
+{
+    if(task_state[i] == SCHED_RUNNING)
+    {
+        class_running[task_class[i]]--;
+        run_num--;
+        metric_add(running, -1);
+    }
+    task_state[i] = SCHED_NONE;
+}
 /* add a node back to the free list */
 void task_put(int i)
 {
     task_count--;
     task_pids[i] = avaliable_list;
     avaliable_list = -i;
+    if(listen_paused)
+        listen_resume();
+    out_reset(i);
+    task_draining[i] = 0;
     if(task_socks[i] > 0)
         close(task_socks[i]);
     task_socks[i] = -1;
-    if(task_buf[i])
-        task_freebuf(i);
+    stream_close(i);
+    timer_del(i);
+    task_timedout[i] = 0;
+    sched_done(i);
+    task_freebuf(i);
+    free(task_captures[i].buf);
+    task_captures[i].buf = NULL;
+    if(batches[i].total >= 0)
+    {
+        batches[i].total = -1;
+        batch_num--;
+    }
+    if(batch_parent[i] >= 0)    /* an item put before it exited */
+        batch_item_done(i, TASK_NOT_RUN, NULL);
 }
-/* find the node by pid */
-int task_find(pid_t pid)
+/* copy the request into the slot unless it was read there, a ring buffer is given back */
+struct taskbuf *task_keepbuf(int i, char buf[], int l)
 {
-    int i;
-    for (i = 0; i < MAX_TASKS; ++i) {
-        if(task_pids[i] == pid)
-            return i;
-    }
-    fprintf(stderr, "pid %d not found\n", pid);
-#ifndef NDEBUG
-    for (i = 0; i < MAX_TASKS; ++i) {
-        fprintf(stderr, "i %d pid %d socks %d\n", i, task_pids[i], task_socks[i]);
+    struct taskbuf *data = task_getbuf(i);
+    if(buf != data->buf)
+    {
+        memcpy(data->buf, buf, l);
+        data->len = l;
     }
-#endif
-    return -1;
+    return data;
 }
 
 
@@ -176,16 +717,169 @@ void split_request(char buf[], int l, char *argv[], int argc)
     fprintf(stderr, "\n");
 #endif
 }
-void exec_process(int fd, int type, char buf[], int len)
+/* builtin handlers run in the child without exec, they never return */
+void builtin_true(char *argv[])
+{
+    _exit(0);
+}
+void builtin_false(char *argv[])
+{
+    _exit(1);
+}
+void builtin_echo(char *argv[])
+{
+    int i;
+    for (i = 1; argv[i] != NULL; ++i) {
+        fputs(argv[i], stdout);
+        if(argv[i+1] != NULL)
+            fputc(' ', stdout);
+    }
+    fputc('\n', stdout);
+    fflush(stdout);
+    _exit(ferror(stdout) ? 1 : 0);
+}
+/* the data of the filter, put next to struct awk_st */
+struct filter_cols
+{
+    int cols[FILTER_COLS];
+    int num;
+};
+struct filter_st
+{
+    struct awk_st awk;
+    struct filter_cols cols;
+};
+int filter_line(int row_idx, char *fields[], int num_of_fields, void *data)
+{
+    struct filter_cols *c = data;
+    int k;
+    for (k = 0; k < c->num; ++k) {
+        const char *v = c->cols[k] < num_of_fields ? fields[c->cols[k]] : "";
+        if(k > 0)
+            fputc(' ', stdout);
+        fwrite(v, 1, strcspn(v, "\n"), stdout);     /* $0 has the newline */
+    }
+    fputc('\n', stdout);
+    return ferror(stdout) ? AWK_BREAK : AWK_CONTINUE;
+}
+/* also the last line of the output, the client of PIPE gets no status */
+void filter_fail(const char *fmt, ...)
+{
+    va_list ap;
+    int k;
+    for (k = 0; k < 2; ++k) {
+        FILE *f = k == 0 ? stdout : stderr;
+        fputs("filter: ", f);
+        va_start(ap, fmt);
+        vfprintf(f, fmt, ap);
+        va_end(ap);
+        fputc('\n', f);
+        fflush(f);
+    }
+    _exit(2);
+}
+/* filter#delim#columns#pattern..., stdin to stdout */
+void builtin_filter(char *argv[])
+{
+    struct filter_st f;
+    char *fields[FILTER_FIELDS];
+    const char *delim = argv[1] ? argv[1] : "";
+    const char *p = argv[1] && argv[2] ? argv[2] : "";
+    int k, field0 = 0, fieldnum = 2;
+
+    memset(&f, 0, sizeof f);
+    for (f.cols.num = 0; *p && f.cols.num < FILTER_COLS; ++f.cols.num) {
+        char *end;
+        long col = strtol(p, &end, 10);
+        if(end == p || col < 0 || col >= FILTER_FIELDS-1)
+            filter_fail("wrong columns %s", argv[2]);
+        f.cols.cols[f.cols.num] = col;
+        field0 |= col == 0;
+        if(col+2 > fieldnum)
+            fieldnum = col+2;   /* one more for the rest of the line */
+        p = *end == ',' ? end+1 : end;
+    }
+    if(f.cols.num == 0)     /* the whole line */
+    {
+        f.cols.cols[f.cols.num++] = 0;
+        field0 = 1;
+    }
+    for (k = 0; argv[1] && argv[2] && argv[3+k] != NULL; ++k) {
+        if(k == PATTERN_NUM || strlen(argv[3+k]) >= PATTERN_SIZE)
+            filter_fail("%d patterns of %d chars at most", PATTERN_NUM, PATTERN_SIZE-1);
+        strcpy(f.awk.pattern[k], argv[3+k]);
+        f.awk.actions[k] = filter_line;
+    }
+    f.awk.pattern_num = k;
+    f.awk.actions[0] = filter_line;     /* the default with no pattern */
+
+    fields[0] = field0 ? AWK_FIELD0_USED : NULL;
+    f.awk.field_rest = 1;
+    int ret = awk__(stdin, delim, NULL, FILTER_LINE_MAX, fields, fieldnum, &f.awk);
+    if(ret != AWK_OK)
+        filter_fail("%s", awk_error(ret));
+    fflush(stdout);
+    _exit(ferror(stdout) ? 1 : 0);
+}
+struct builtin
+{
+    const char *name;
+    void (*run)(char *argv[]);
+    int plain;      /* no options here, the real one runs if an argument starts with '-' */
+} builtins[] =
+{
+    {"true", builtin_true, 0},
+    {"false", builtin_false, 0},
+    {"echo", builtin_echo, 1},     /* like "echo -n" */
+    {"filter", builtin_filter, 0},
+};
+int builtin_find(const char *name)
+{
+    int i;
+    for (i = 0; i < sizeof builtins/sizeof builtins[0]; ++i) {
+        if(strcmp(name, builtins[i].name) == 0)
+            return i;
+    }
+    return -1;
+}
+int builtin_usable(int k, char *argv[])
+{
+    int i;
+    for (i = 1; builtins[k].plain && argv[i] != NULL; ++i) {
+        if(argv[i][0] == '-')
+            return 0;
+    }
+    return 1;
+}
+/* exe is the executable resolved by the proxy, -1 to search PATH here */
+void run_argv(char *argv[], int exe)
+{
+    int i;
+    if(argv[0] == NULL)
+        return;
+    exec_mark();
+    if((i = builtin_find(argv[0])) >= 0 && builtin_usable(i, argv))
+    {
+        /* no exec closes the fds of the proxy, like the sockets of other clients */
+        close_range(3, ~0U, 0);
+        builtins[i].run(argv);
+    }
+    if(exe >= 0)
+        execveat(exe, "", argv, environ, AT_EMPTY_PATH);
+    /* ENOENT for a script, the fd is close on exec and can't be reopened by
+       the interpreter, let execvp do it */
+    execvp(argv[0], argv);
+}
+void exec_process(int fd, int type, char buf[], int len, int exe)
 {
     char *argv[ARGV_MAX];
 
     close(fd);  /* write nothing, so close it immediately */
     split_request(buf, len, argv, ARGV_MAX);
-    execvp(argv[0], argv);
+    run_argv(argv, exe);
     error_exist("exec_process");
 }
-void pipe_process(int fd, int type, char buf[], int len)
+void pipe_process(int fd, int type, char buf[], int len, int exe)
 {
     char *argv[ARGV_MAX];
 
@@ -194,70 +888,1904 @@ void pipe_process(int fd, int type, char buf[], int len)
     {
         error_exist("dup2");
     }
-    execvp(argv[0], argv);
+    fcntl(1, F_SETFL, fcntl(1, F_GETFL, 0) & ~O_NONBLOCK);    /* set by the proxy */
+    run_argv(argv, exe);
     error_exist("pipe_process");
 }
+void stream_process(int fd, int type, char buf[], int len, int out, int err, int exe)
+{
+    char *argv[ARGV_MAX];
 
-void after_wait(pid_t pid, int status)
+    close(fd);  /* frames are written by the proxy */
+    split_request(buf, len, argv, ARGV_MAX);
+    if(dup2(out, 1) == -1 || dup2(err, 2) == -1)
+    {
+        error_exist("dup2");
+    }
+    run_argv(argv, exe);
+    error_exist("stream_process");
+}
+/* io[0] and io[1] are stdin and stdout, -1 to keep those of the proxy */
+void stage_process(int fd, char buf[], int len, int io[2], int exe)
 {
-    pid_count--;
-    int i = task_find(pid);
-    if(i >= 0)
+    char *argv[ARGV_MAX];
+
+    split_request(buf, len, argv, ARGV_MAX);
+    if((io[0] >= 0 && dup2(io[0], 0) == -1) || (io[1] >= 0 && dup2(io[1], 1) == -1))
     {
-        if(task_socks[i] > 0)
-        {
-            char buf[12];
-            int32_t s32 = status;
-            memcpy(buf, RETURN_MARK, sizeof RETURN_MARK -1);
-            memcpy(buf+sizeof RETURN_MARK -1, &s32, sizeof s32);
-            int ret = write(task_socks[i], buf, sizeof RETURN_MARK -1 + sizeof s32);
-            if(ret < 0)
-                perror("after_wait write");
-        }
-        task_put(i);
+        error_exist("dup2");
     }
+    if(io[1] == fd)
+        fcntl(1, F_SETFL, fcntl(1, F_GETFL, 0) & ~O_NONBLOCK);    /* set by the proxy */
+    run_argv(argv, exe);
+    error_exist("stage_process");
 }
+void cg_enter(int leaf);
+/* in the child of a fork or in a helper of the pool, no return */
+void child_run(int cl, int type, char buf[], int len, int wr[2], int exe, int leaf, int owner)
+{
+    sigset_t mask;
 
-int client_readbuf(int cl, char buf[], int size)
+    child_owner = owner;
+    sigemptyset(&mask);     /* undo what the proxy set for itself */
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    signal(SIGPIPE, SIG_DFL);
+    cg_enter(leaf);
+    switch(type)
+    {
+        case EXECID:
+        case NRETID:
+            exec_process(cl, type, buf, len, exe);
+        case PIPEID:
+            pipe_process(cl, type, buf, len, exe);
+        case STRMID:
+            stream_process(cl, type, buf, len, wr[0], wr[1], exe);
+        case PPLNID:
+            stage_process(cl, buf, len, wr, exe);
+    }
+    _exit(EXIT_FAILURE);
+}
+
+/*
+ * the pool keeps helpers forked in advance, each waits on a socketpair for
+ * one request and the fds it needs, then does what the child of a fork does.
+ * so fork is out of the way of a request, it is done when the loop is idle.
+ * the number of idle helpers follows the requests seen per POOL_PERIOD_MS.
+ * a helper is retired by closing its socket, it exits when it reads EOF.
+ */
+struct pool_msg
 {
-    int l = 0;
-    int ret;
+    int type;
+    int len;
+    int exe;        /* 1 if the resolved executable is the last fd */
+    int leaf;       /* the cgroup to enter, -1 if none */
+    int owner;      /* reactor*MAX_TASKS+i, for exec_marks */
+};
+int pool_max = POOL_DEFAULT;
+int pool_num, pool_idle;
+pid_t pool_pids[POOL_LIMIT];
+int   pool_socks[POOL_LIMIT];   /* -1 if retired and not reaped yet */
+int pool_requests, pool_rate;   /* pool_rate is in 1/16 */
+long long pool_period;
 
-    if(size <= 0)
+long long now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000LL + ts.tv_nsec/1000000;
+}
+
+void pool_helper(int sock)
+{
+    char buf[REQUESTBUF_SIZE];
+    struct pool_msg hdr;
+    int fds[4] = {-1, -1, -1, -1};
+    char cbuf[CMSG_SPACE(sizeof fds)];
+    struct iovec iov[2] = {{&hdr, sizeof hdr}, {buf, sizeof buf}};
+    struct msghdr msg;
+    ssize_t n;
+
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = sizeof cbuf;
+    while((n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR)
+        ;
+    if(n < (ssize_t)sizeof hdr)     /* retired or the proxy is gone */
+        _exit(0);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if(cmsg == NULL || cmsg->cmsg_type != SCM_RIGHTS)
+        _exit(EXIT_FAILURE);
+    memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+    /* fds are close on exec, what the task keeps is dup2ed.
+       the order is the client, the pipes of STRM, the executable */
+    int k = hdr.type == STRMID ? 3 : 1;
+    child_run(fds[0], hdr.type, buf, hdr.len, &fds[1], hdr.exe ? fds[k] : -1, hdr.leaf, hdr.owner);
+}
+int pool_fork(void)
+{
+    int sv[2];
+
+    if(socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, sv) == -1)
     {
-        fprintf(stderr, "request too long\n");
+        perror("pool_fork socketpair");
         return -1;
     }
-
-    while(size - l > 0)
+    pid_t pid = fork();
+    if(pid < 0)
     {
-        ret = read(cl, buf+l, size-l);
-        if(ret < 0)
+        perror("pool_fork fork");
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+    else if(pid == 0)
+    {
+        /* drop the sockets of clients and everything else of the proxy */
+        close_range(3, sv[1]-1, 0);
+        close_range(sv[1]+1, ~0U, 0);
+        pool_helper(sv[1]);
+    }
+    close(sv[1]);
+    pool_pids[pool_num] = pid;
+    pool_socks[pool_num] = sv[0];
+    pool_num++;
+    pool_idle++;
+    return 0;
+}
+/* resize the pool to the recent rate, called every loop */
+void pool_refill(void)
+{
+    int k, n;
+    long long now = now_ms();
+
+    if(pool_max <= 0)
+        return;
+    for (n = 0; now - pool_period >= POOL_PERIOD_MS; ++n) {
+        if(n >= 16)     /* idle for long, the history is all gone */
         {
-            if(errno != EAGAIN && errno != EWOULDBLOCK)
-            {
-                perror("client_readbuf read");
-                return -1;
-            }
+            pool_period = now;
             break;
         }
-        else if(ret == 0)       /* EOF */
-            break;
-        else
-            l += ret;
+        pool_rate = (pool_rate*(POOL_EWMA-1) + pool_requests*16)/POOL_EWMA;
+        pool_requests = 0;
+        pool_period += POOL_PERIOD_MS;
     }
-    if(ret == 0 && l+1 <= size && l-1 >= 0 &&buf[l-1] != 0)
-        buf[l++] = 0;    /* must end with 0, append one if not exist */
 
-    if(size-l == 0 && buf[l-1] != 0)
-    {
-        fprintf(stderr, "request too long\n");
-        return -1;
+    int target = (pool_rate+15)/16;
+    if(target < 1)
+        target = 1;
+    if(target > pool_max)
+        target = pool_max;
+
+    for (k = pool_num-1; k >= 0 && pool_idle > target; --k) {
+        if(pool_socks[k] >= 0)
+        {
+            close(pool_socks[k]);
+            pool_socks[k] = -1;
+            pool_idle--;
+        }
+    }
+    for (n = 0; n < POOL_REFILL && pool_idle < target && pool_num < POOL_LIMIT; ++n) {
+        if(pool_fork() < 0)
+            break;
     }
-    return l;
 }
-
-void client_after_read(int i, char buf[], int l)
+/* remove a helper from the pool, by index */
+void pool_remove(int k)
+{
+    if(pool_socks[k] >= 0)
+    {
+        close(pool_socks[k]);
+        pool_idle--;
+    }
+    pool_num--;
+    pool_pids[k] = pool_pids[pool_num];
+    pool_socks[k] = pool_socks[pool_num];
+}
+/* return 1 if pid is a helper not handed a request */
+int pool_reaped(pid_t pid)
+{
+    int k;
+    for (k = 0; k < pool_num; ++k) {
+        if(pool_pids[k] == pid)
+        {
+            pool_remove(k);
+            return 1;
+        }
+    }
+    return 0;
+}
+/* hand a request to an idle helper, return its pid or -1 to fork instead */
+pid_t pool_dispatch(int cl, int type, char buf[], int len, int wr[2], int exe, int leaf, int owner)
+{
+    int k, nfds;
+    int fds[4];
+    char cbuf[CMSG_SPACE(sizeof fds)];
+    struct pool_msg hdr = {type, len, exe >= 0, leaf, owner};
+    struct iovec iov[2] = {{&hdr, sizeof hdr}, {buf, len}};
+    struct msghdr msg;
+
+    pool_requests++;
+    for (k = pool_num-1; k >= 0 && pool_socks[k] < 0; --k)
+        ;
+    if(k < 0)
+        return -1;
+
+    fds[0] = cl;
+    nfds = 1;
+    if(type == STRMID)
+    {
+        fds[1] = wr[0];
+        fds[2] = wr[1];
+        nfds = 3;
+    }
+    if(exe >= 0)
+        fds[nfds++] = exe;
+    memset(&msg, 0, sizeof msg);
+    msg.msg_iov = iov;
+    msg.msg_iovlen = 2;
+    msg.msg_control = cbuf;
+    msg.msg_controllen = CMSG_SPACE(nfds*sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds*sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds*sizeof(int));
+
+    if(sendmsg(pool_socks[k], &msg, MSG_NOSIGNAL) < 0)
+    {
+        perror("pool_dispatch sendmsg");
+        close(pool_socks[k]);   /* retire it, reaped later */
+        pool_socks[k] = -1;
+        pool_idle--;
+        return -1;
+    }
+    pid_t pid = pool_pids[k];
+    pool_remove(k);     /* it is a task now */
+    return pid;
+}
+
+/*
+ * the proxy resolves argv[0] itself and keeps the executable open, the child
+ * runs it by execveat, so PATH is not walked with failed execve every time.
+ * an entry is checked with a stat of the path and dropped if the inode or
+ * the mtime changed. if an allowlist is loaded by -a, nothing else can run.
+ */
+struct exe_entry
+{
+    char name[EXE_NAME_MAX];
+    char path[PATH_MAX];
+    int fd;         /* -1 if unused */
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+};
+struct exe_entry exe_cache[EXE_CACHE_SIZE];
+char allow_names[ALLOW_MAX][EXE_NAME_MAX];
+int allow_num;
+
+void exe_prepare(void)
+{
+    int i;
+    for (i = 0; i < EXE_CACHE_SIZE; ++i) {
+        exe_cache[i].fd = -1;
+    }
+}
+/* one name per line, empty lines and lines start with # are skipped */
+int allow_load(const char *filename)
+{
+    char line[EXE_NAME_MAX+2];
+    FILE *stream = fopen(filename, "r");
+    if(stream == NULL)
+        return -1;
+    while(fgets(line, sizeof line, stream))
+    {
+        line[strcspn(line, "\r\n")] = 0;
+        if(line[0] == 0 || line[0] == '#')
+            continue;
+        if(allow_num == ALLOW_MAX)
+        {
+            fprintf(stderr, "too many names in %s\n", filename);
+            break;
+        }
+        strcpy(allow_names[allow_num++], line);
+    }
+    fclose(stream);
+    return 0;
+}
+int allow_check(const char *name)
+{
+    int i;
+    if(allow_num == 0)
+        return 1;
+    for (i = 0; i < allow_num; ++i) {
+        if(strcmp(allow_names[i], name) == 0)
+            return 1;
+    }
+    return 0;
+}
+/* copy argv[0] of the request to name if it fits, return its length or -1 if missing */
+int request_cmd(const char buf[], int l, char name[], int size)
+{
+    const char *p = memchr(buf, DELIM, l);
+    int n;
+    if(p == NULL)
+        return -1;
+    p++;
+    for (n = 0; p+n < buf+l && p[n] != DELIM && p[n] != 0; ++n)
+        ;
+    if(n == 0)
+        return -1;
+    if(n < size)
+    {
+        memcpy(name, p, n);
+        name[n] = 0;
+    }
+    return n;
+}
+/* the line of BTCH or PPLN at pos or after, empty lines are skipped. return
+   where it is and its length in n, -1 if no more. pos is moved past it */
+int request_line(const char buf[], int l, int *pos, int *n)
+{
+    while(*pos < l)
+    {
+        const char *p = buf + *pos;
+        const char *end = memchr(p, '\n', l - *pos);
+        int at = *pos;
+
+        *n = end != NULL ? end - p : (int)strnlen(p, l - *pos);
+        *pos += *n + 1;
+        if(*n > 0)
+            return at;
+    }
+    return -1;
+}
+/* copy a line as a request of its own, "#cmd#args" \0 is contained, return the length.
+   the lines after the first may have no DELIM */
+int request_line_copy(char dst[], const char line[], int n)
+{
+    int d = line[0] != DELIM;
+    dst[0] = DELIM;
+    memcpy(dst + d, line, n);
+    dst[d+n] = 0;
+    return d+n+1;
+}
+unsigned int exe_hash(const char *name)
+{
+    unsigned int h = 5381;
+    while(*name)
+        h = h*33 + (unsigned char)*name++;
+    return h;
+}
+/* find name in PATH like execvp, the path found is put in path */
+int path_search(const char *name, char path[], int size, struct stat *st)
+{
+    const char *dir = getenv("PATH");
+    if(dir == NULL)
+        dir = DEFAULT_PATH;
+    while(1)
+    {
+        int n = strcspn(dir, ":");
+        if(snprintf(path, size, "%.*s/%s", n, n ? dir : ".", name) < size
+                && stat(path, st) == 0 && S_ISREG(st->st_mode) && access(path, X_OK) == 0)
+            return 0;
+        if(dir[n] == 0)
+            return -1;
+        dir += n+1;
+    }
+}
+/* find name like execvp, open it and fill e */
+int exe_open(const char *name, struct exe_entry *e)
+{
+    struct stat st;
+
+    if(strchr(name, '/'))
+    {
+        if(strlen(name) >= sizeof e->path)
+            return -1;
+        strcpy(e->path, name);
+    }
+    else if(path_search(name, e->path, sizeof e->path, &st) < 0)
+        return -1;
+    e->fd = open(e->path, O_PATH|O_CLOEXEC);
+    if(e->fd < 0)
+        return -1;
+    if(fstat(e->fd, &st) == -1)
+    {
+        close(e->fd);
+        e->fd = -1;
+        return -1;
+    }
+    strcpy(e->name, name);
+    e->dev = st.st_dev;
+    e->ino = st.st_ino;
+    e->mtime = st.st_mtim;
+    return e->fd;
+}
+/* return the fd of the executable of name, -1 if not found, the child will report it */
+int exe_lookup(const char *name)
+{
+    int k;
+    unsigned int h = exe_hash(name);
+    struct exe_entry *victim = NULL;
+
+    for (k = 0; k < EXE_PROBE; ++k) {
+        struct exe_entry *e = &exe_cache[(h+k)%EXE_CACHE_SIZE];
+        if(e->fd < 0)
+        {
+            if(victim == NULL)
+                victim = e;
+            continue;
+        }
+        if(strcmp(e->name, name) != 0)
+            continue;
+
+        struct stat st;
+        if(stat(e->path, &st) == 0 && st.st_dev == e->dev && st.st_ino == e->ino
+                && st.st_mtim.tv_sec == e->mtime.tv_sec && st.st_mtim.tv_nsec == e->mtime.tv_nsec)
+            return e->fd;
+        close(e->fd);   /* replaced or removed, resolve again */
+        e->fd = -1;
+        victim = e;
+        break;
+    }
+    if(victim == NULL)  /* all taken, evict the first */
+    {
+        victim = &exe_cache[h%EXE_CACHE_SIZE];
+        close(victim->fd);
+        victim->fd = -1;
+    }
+    return exe_open(name, victim);
+}
+
+/*
+ * the results of EXEC and PIPE with c=, shared by the reactors under
+ * cache_lock. an entry is in a bucket of the hash and in the LRU list, most
+ * recent first, the least recent go when the output is over cache_max. an
+ * entry being replied has a reference, it is freed after the last one
+ */
+struct cache_entry
+{
+    uint64_t key;
+    long long expire;       /* now_ms() */
+    int status;
+    char *data;             /* the output of PIPE */
+    int len;
+    int refs;               /* 1 of the table, 1 of each reply */
+    struct cache_entry *next;
+    struct cache_entry *lru_prev, *lru_next;
+};
+struct cache_entry *cache_table[CACHE_BUCKETS];
+struct cache_entry cache_lru = {.lru_prev = &cache_lru, .lru_next = &cache_lru};
+long long cache_max = (long long)CACHE_DEFAULT_MB << 20;
+long long cache_bytes;
+uint64_t cache_env;     /* of the cwd and the environment of the proxy, the tasks inherit them */
+pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* FNV-1a */
+uint64_t cache_hash(uint64_t h, const void *data, size_t n)
+{
+    const unsigned char *p = data;
+    while(n-- > 0)
+        h = (h ^ *p++) * 0x100000001b3ULL;
+    return h;
+}
+void cache_prepare(void)
+{
+    char cwd[PATH_MAX];
+    char **env;
+
+    cache_env = 0xcbf29ce484222325ULL;
+    if(getcwd(cwd, sizeof cwd) != NULL)
+        cache_env = cache_hash(cache_env, cwd, strlen(cwd)+1);
+    for (env = environ; *env != NULL; ++env) {
+        cache_env = cache_hash(cache_env, *env, strlen(*env)+1);
+    }
+}
+/* the key of a request, see c= */
+uint64_t cache_key(int type, const char buf[], int l)
+{
+    const char *p = memchr(buf, DELIM, l), *end = buf + l;
+    char name[PATH_MAX], path[PATH_MAX];
+    struct stat st;
+    uint64_t h = cache_hash(cache_env, &type, sizeof type);
+    int k, n;
+
+    if(p == NULL)
+        return h;
+    h = cache_hash(h, p, end - p);
+    for (k = 0; p < end; ++k, p += n+1) {
+        const char *f = p+1;
+        for (n = 0; f+n < end && f[n] != DELIM && f[n] != 0; ++n)
+            ;
+        if(n == 0 || n >= sizeof name)
+            continue;
+        memcpy(name, f, n);
+        name[n] = 0;
+        if(memchr(name, '/', n) != NULL ? stat(name, &st) < 0
+                : k > 0 || path_search(name, path, sizeof path, &st) < 0)
+            continue;
+        h = cache_hash(h, &st.st_mtim, sizeof st.st_mtim);
+        h = cache_hash(h, &st.st_size, sizeof st.st_size);
+        h = cache_hash(h, &st.st_ino, sizeof st.st_ino);
+    }
+    return h;
+}
+void cache_release(struct cache_entry *e)
+{
+    pthread_mutex_lock(&cache_lock);
+    int refs = --e->refs;
+    pthread_mutex_unlock(&cache_lock);
+    if(refs == 0)
+    {
+        free(e->data);
+        free(e);
+    }
+}
+/* take it out of the table, cache_lock is held */
+void cache_unlink(struct cache_entry *e)
+{
+    struct cache_entry **pp = &cache_table[e->key%CACHE_BUCKETS];
+    while(*pp != e)
+        pp = &(*pp)->next;
+    *pp = e->next;
+    e->lru_prev->lru_next = e->lru_next;
+    e->lru_next->lru_prev = e->lru_prev;
+    cache_bytes -= sizeof *e + e->len;
+    if(--e->refs == 0)
+    {
+        free(e->data);
+        free(e);
+    }
+}
+/* return the entry with a reference, NULL if none or expired */
+struct cache_entry *cache_lookup(uint64_t key)
+{
+    struct cache_entry *e;
+
+    pthread_mutex_lock(&cache_lock);
+    for (e = cache_table[key%CACHE_BUCKETS]; e != NULL && e->key != key; e = e->next)
+        ;
+    if(e != NULL && e->expire <= now_ms())
+    {
+        cache_unlink(e);
+        e = NULL;
+    }
+    if(e != NULL)
+    {
+        e->lru_prev->lru_next = e->lru_next;    /* to the front */
+        e->lru_next->lru_prev = e->lru_prev;
+        e->lru_next = cache_lru.lru_next;
+        e->lru_prev = &cache_lru;
+        cache_lru.lru_next->lru_prev = e;
+        cache_lru.lru_next = e;
+        e->refs++;
+    }
+    __atomic_store_n(&metrics.cache_bytes, cache_bytes, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache_lock);
+    return e;
+}
+/* data is taken by the cache, freed if it is not kept */
+void cache_insert(uint64_t key, char *data, int len, int status, int ttl_ms)
+{
+    struct cache_entry *e = malloc(sizeof *e), *old;
+
+    if(e == NULL || sizeof *e + len > cache_max)
+    {
+        free(e);
+        free(data);
+        return;
+    }
+    e->key = key;
+    e->expire = now_ms() + ttl_ms;
+    e->status = status;
+    e->data = data;
+    e->len = len;
+    e->refs = 1;
+
+    pthread_mutex_lock(&cache_lock);
+    for (old = cache_table[key%CACHE_BUCKETS]; old != NULL && old->key != key; old = old->next)
+        ;
+    if(old != NULL)     /* run again by another client at the same time */
+        cache_unlink(old);
+    e->next = cache_table[key%CACHE_BUCKETS];
+    cache_table[key%CACHE_BUCKETS] = e;
+    e->lru_next = cache_lru.lru_next;
+    e->lru_prev = &cache_lru;
+    cache_lru.lru_next->lru_prev = e;
+    cache_lru.lru_next = e;
+    cache_bytes += sizeof *e + len;
+    while(cache_bytes > cache_max)
+        cache_unlink(cache_lru.lru_prev);
+    __atomic_store_n(&metrics.cache_bytes, cache_bytes, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/*
+ * cgroup v2, by -g dir. dir is a group delegated to the proxy and the proxy is
+ * not in it. each class has a group c<class> in it, limited by -l like
+ * -l "2:cpu.max=50000 100000" -l 2:memory.max=256M -l "1:io.max=8:0 wbps=1048576".
+ * a task runs in a leaf c<class>/r<reactor>t<slot>, made when the slot is used
+ * in the class for the first time and kept, the child moves itself there
+ * before exec. memory.events of the leaf tells if the OOM killer did something
+ * to the task. all of it is of the spawner
+ */
+struct cg_limit
+{
+    int cls;
+    char file[32];
+    char value[64];
+};
+char cg_base[CGROUP_PATH_MAX-64];   /* empty if not used, the rest is for the leaves */
+struct cg_limit cg_limits[CGROUP_LIMIT_MAX];
+int cg_limit_num;
+char cg_made[CLASS_NUM*SPAWN_MAX];
+long long cg_ooms[CLASS_NUM*SPAWN_MAX];    /* oom_kill of a leaf seen so far */
+const char *cg_controllers[] = {"+cpu", "+memory", "+io"};
+
+int cg_write(const char *dir, const char *file, const char *value)
+{
+    char path[CGROUP_PATH_MAX+32];
+    snprintf(path, sizeof path, "%s/%s", dir, file);
+    int fd = open(path, O_WRONLY|O_CLOEXEC);
+    if(fd < 0)
+        return -1;
+    int ret = write(fd, value, strlen(value));
+    close(fd);
+    return ret < 0 ? -1 : 0;
+}
+/* "class:file=value" of -l */
+int cg_limit_parse(const char *arg)
+{
+    struct cg_limit *l = &cg_limits[cg_limit_num];
+    int n = -1;
+
+    if(cg_limit_num == CGROUP_LIMIT_MAX)
+        return -1;
+    if(sscanf(arg, "%d:%31[^=/]=%n", &l->cls, l->file, &n) != 2 || n < 0
+            || l->cls < 0 || l->cls >= CLASS_NUM || strlen(arg+n) >= sizeof l->value)
+        return -1;
+    strcpy(l->value, arg+n);
+    cg_limit_num++;
+    return 0;
+}
+/* make the groups of the classes and limit them, before any task */
+void cg_prepare(void)
+{
+    char dir[CGROUP_PATH_MAX];
+    int c, k;
+
+    for (k = 0; k < sizeof cg_controllers/sizeof cg_controllers[0]; ++k) {
+        if(cg_write(cg_base, "cgroup.subtree_control", cg_controllers[k]) < 0)
+            fprintf(stderr, "cgroup controller %s: %s\n", cg_controllers[k]+1, strerror(errno));
+    }
+    for (c = 0; c < CLASS_NUM; ++c) {
+        snprintf(dir, sizeof dir, "%s/c%d", cg_base, c);
+        if(mkdir(dir, 0755) == -1 && errno != EEXIST)
+            error_exist(dir);
+        /* for the leaves, memory.events is there only with the controller */
+        for (k = 0; k < sizeof cg_controllers/sizeof cg_controllers[0]; ++k)
+            cg_write(dir, "cgroup.subtree_control", cg_controllers[k]);
+    }
+    for (k = 0; k < cg_limit_num; ++k) {
+        snprintf(dir, sizeof dir, "%s/c%d", cg_base, cg_limits[k].cls);
+        if(cg_write(dir, cg_limits[k].file, cg_limits[k].value) < 0)
+        {
+            fprintf(stderr, "cgroup c%d/%s: %s\n", cg_limits[k].cls, cg_limits[k].file, strerror(errno));
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+void cg_leaf_path(char path[], int size, int leaf)
+{
+    int owner = leaf%SPAWN_MAX;
+    snprintf(path, size, "%s/c%d/r%dt%d", cg_base, leaf/SPAWN_MAX, owner/MAX_TASKS, owner%MAX_TASKS);
+}
+/* oom_kill in memory.events of a leaf, it only grows */
+long long cg_oom_count(int leaf)
+{
+    char path[CGROUP_PATH_MAX+16], line[64];
+    long long n = 0;
+
+    cg_leaf_path(path, CGROUP_PATH_MAX, leaf);
+    strcat(path, "/memory.events");
+    FILE *stream = fopen(path, "re");
+    if(stream == NULL)
+        return 0;
+    while(fgets(line, sizeof line, stream))
+    {
+        if(sscanf(line, "oom_kill %lld", &n) == 1)
+            break;
+    }
+    fclose(stream);
+    return n;
+}
+/* the leaf of the slot owner (reactor*MAX_TASKS+i) in a class,
+   -1 if there is no cgroup, -2 if it can't be made */
+int cg_leaf(int cls, int owner)
+{
+    char path[CGROUP_PATH_MAX];
+    int leaf = cls*SPAWN_MAX + owner;
+
+    if(cg_base[0] == 0)
+        return -1;
+    if(!cg_made[leaf])
+    {
+        cg_leaf_path(path, sizeof path, leaf);
+        if(mkdir(path, 0755) == -1 && errno != EEXIST)
+        {
+            perror("cg_leaf mkdir");
+            return -2;
+        }
+        cg_made[leaf] = 1;
+        cg_ooms[leaf] = cg_oom_count(leaf);     /* left by a proxy before */
+    }
+    return leaf;
+}
+/* 1 if the OOM killer has killed in the leaf since the last check */
+int cg_oom_check(int leaf)
+{
+    long long n = cg_oom_count(leaf);
+    int killed = n > cg_ooms[leaf];
+    cg_ooms[leaf] = n;
+    return killed;
+}
+/* in the child, move itself into the leaf */
+void cg_enter(int leaf)
+{
+    char path[CGROUP_PATH_MAX];
+    if(leaf < 0)
+        return;
+    cg_leaf_path(path, sizeof path, leaf);
+    if(cg_write(path, "cgroup.procs", "0") < 0)
+        error_exist("cg_enter");
+}
+
+/* options are put between CMD and the first DELIM, like "strm,r#ls" */
+int parse_options(const char buf[], int l, struct taskopt *opt)
+{
+    int i = CMDLEN;
+
+    memset(opt, 0, sizeof *opt);
+    opt->timeout_ms = -1;
+    opt->prio = -1;
+    opt->limit = -1;
+    opt->cache_ms = 0;
+    while(i+1 < l && buf[i] == OPT_DELIM)
+    {
+        char key = buf[i+1];
+        long val = -1;
+
+        i += 2;
+        if(i < l && buf[i] == '=')     /* the request ends with \0, strtol stops there */
+        {
+            char *end;
+            val = strtol(&buf[i+1], &end, 10);
+            if(end == &buf[i+1] || val < 0 || val > INT_MAX)
+                return -1;
+            i = end - buf;
+        }
+        switch(key)
+        {
+            case 'r':
+                opt->flags |= OPT_RUSAGE;
+                break;
+            case 'j':
+                opt->flags |= OPT_JSON;
+                break;
+            case 'o':
+                opt->flags |= OPT_OUTPUT;
+                break;
+            case 't':
+                if(val < 0)
+                    return -1;
+                opt->timeout_ms = val;
+                break;
+            case 'p':
+                if(val < 0 || val >= CLASS_NUM)
+                    return -1;
+                opt->prio = val;
+                break;
+            case 'n':
+                if(val < 1)
+                    return -1;
+                opt->limit = val;
+                break;
+            case 'c':
+                if(val < 0)
+                    return -1;
+                opt->cache_ms = val;
+                break;
+            default:
+                return -1;
+        }
+    }
+    if(i < l && buf[i] != DELIM && buf[i] != 0)
+        return -1;
+    return 0;
+}
+
+/* watch EPOLLOUT of the client while something is queued */
+int out_watch(int i, int on)
+{
+    struct epoll_event ev;
+
+    if(task_outwatch[i] == on)
+        return 0;
+    ev.events = EPOLLOUT;
+    ev.data.fd = ev_encode(EV_OUTPUT, i);
+    if(epoll_ctl(epollfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, task_socks[i], &ev) == -1)
+    {
+        perror("out_watch epoll_ctl");
+        return -1;
+    }
+    task_outwatch[i] = on;
+    return 0;
+}
+void cache_release(struct cache_entry *e);
+/* drop what is queued, the client is gone or the slot is put */
+void out_reset(int i)
+{
+    struct outq *q = &task_outq[i];
+
+    if(task_outwatch[i])
+    {
+        /* a child may share the socket, so remove it explicitly */
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, task_socks[i], NULL);
+        task_outwatch[i] = 0;
+    }
+    if(q->entry != NULL)
+        cache_release(q->entry);
+    else
+        free(q->buf);
+    memset(q, 0, sizeof *q);
+    task_splice[i] = 0;
+}
+int out_busy(int i)
+{
+    return task_outq[i].off < task_outq[i].len || task_splice[i] > 0;
+}
+/* room for n more bytes at the end of the queue, NULL if no memory */
+char *out_space(int i, int n)
+{
+    struct outq *q = &task_outq[i];
+
+    if(q->len + n > q->size)
+    {
+        int size = q->size > 0 ? 2*q->size : 256;
+        if(size < q->len + n)
+            size = q->len + n;
+        char *buf = realloc(q->buf, size);
+        if(buf == NULL)
+        {
+            perror("out_space realloc");
+            return NULL;
+        }
+        q->buf = buf;
+        q->size = size;
+    }
+    return q->buf + q->len;
+}
+/* queue a frame, the payload may be put later by the caller */
+int out_frame(int i, char tag, const void *data, int32_t len, int32_t payload)
+{
+    char *p = out_space(i, FRAME_HEADER + len);
+
+    if(p == NULL)
+        return -1;
+    p[0] = tag;
+    memcpy(p+1, &payload, sizeof payload);
+    if(len > 0)
+        memcpy(p+FRAME_HEADER, data, len);
+    task_outq[i].len += FRAME_HEADER + len;
+    return 0;
+}
+int out_append(int i, const void *data, int len)
+{
+    char *p = out_space(i, len);
+
+    if(p == NULL)
+        return -1;
+    memcpy(p, data, len);
+    task_outq[i].len += len;
+    return 0;
+}
+/* send what is queued, then the payload of a frame left in a pipe.
+   return 1 if all is sent, 0 if the client is full and EPOLLOUT is watched,
+   -1 if the client is broken, what is queued is dropped */
+int out_flush(int i)
+{
+    struct outq *q = &task_outq[i];
+    int cl = task_socks[i];
+
+    while(out_busy(i))
+    {
+        ssize_t n;
+        if(q->off < q->len)
+            n = send(cl, q->buf + q->off, q->len - q->off, MSG_DONTWAIT|MSG_NOSIGNAL);
+        else
+            n = splice(task_pipes[i][task_splice_pipe[i]], NULL, cl, NULL, task_splice[i],
+                    SPLICE_F_MOVE|SPLICE_F_NONBLOCK);
+        if(n < 0 && errno == EINTR)
+            continue;
+        if(n < 0 && errno == EAGAIN)
+        {
+            if(out_watch(i, 1) == 0)
+                return 0;
+        }
+        else if(n <= 0)
+            perror("out_flush");
+        if(n <= 0)
+        {
+            out_reset(i);
+            return -1;
+        }
+        if(q->off < q->len)
+            q->off += n;
+        else
+            task_splice[i] -= n;
+    }
+    if(q->entry != NULL)    /* a cache hit is sent */
+        out_reset(i);
+    q->off = q->len = 0;
+    out_watch(i, 0);
+    return 1;
+}
+/* create the pipes for a STRM task, the write ends are returned in wr for the child */
+int stream_prepare(int i, int wr[2])
+{
+    int out[2], err[2];
+
+    if(pipe2(out, O_CLOEXEC) == -1)
+    {
+        perror("stream_prepare pipe2");
+        return -1;
+    }
+    if(pipe2(err, O_CLOEXEC) == -1)
+    {
+        perror("stream_prepare pipe2");
+        close(out[0]);
+        close(out[1]);
+        return -1;
+    }
+    task_pipes[i][0] = out[0];
+    task_pipes[i][1] = err[0];
+    wr[0] = out[1];
+    wr[1] = err[1];
+    return 0;
+}
+/* watch the pipes of STRM or PIPE cached, they wait while the client is full */
+int pipes_watch(int i, int on)
+{
+    struct epoll_event ev;
+    int j;
+
+    if(task_pipewatch[i] == on)
+        return 0;
+    for (j = 0; j < 2; ++j) {
+        int p = task_pipes[i][j];
+        if(p < 0)
+            continue;
+        ev.events = EPOLLIN;    /* level triggered, a frame is moved per event */
+        ev.data.fd = ev_encode(EV_STDOUT+j, i);
+        if(epoll_ctl(epollfd, on ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, p, &ev) == -1)
+        {
+            perror("pipes_watch epoll_ctl");
+            return -1;
+        }
+    }
+    task_pipewatch[i] = on;
+    return 0;
+}
+/* watch the pipes, the socket is made nonblocking for splice, that of the ring is not */
+int stream_start(int i)
+{
+    int j;
+    int cl = task_socks[i];
+
+    if(fcntl(cl, F_SETFL, fcntl(cl, F_GETFL, 0) | O_NONBLOCK) == -1)
+    {
+        perror("stream_start fcntl");
+        return -1;
+    }
+    for (j = 0; j < 2; ++j) {
+        int p = task_pipes[i][j];
+        if(fcntl(p, F_SETFL, fcntl(p, F_GETFL, 0) | O_NONBLOCK) == -1)
+        {
+            perror("stream_start fcntl");
+            return -1;
+        }
+    }
+    return pipes_watch(i, 1);
+}
+void stream_close(int i)
+{
+    int j;
+    for (j = 0; j < 2; ++j) {
+        if(task_pipes[i][j] >= 0)
+        {
+            /* a child not exec yet may still share it, so remove it explicitly */
+            epoll_ctl(epollfd, EPOLL_CTL_DEL, task_pipes[i][j], NULL);
+            close(task_pipes[i][j]);
+            task_pipes[i][j] = -1;
+        }
+    }
+    task_pipewatch[i] = 0;
+}
+/* queue a frame of what is in the pipe, its payload is spliced to the client
+   by out_flush, the pipes wait if it can't be sent now.
+   return the size, 0 if nothing in the pipe, -1 if the client is broken */
+int stream_forward(int i, int j)
+{
+    int p = task_pipes[i][j];
+    int n;
+
+    if(ioctl(p, FIONREAD, &n) == -1)
+    {
+        perror("stream_forward ioctl");
+        return -1;
+    }
+    if(n <= 0)
+        return 0;
+    if(n > FRAME_MAX)
+        n = FRAME_MAX;
+    metric_add(bytes_forwarded, n);
+
+    if(out_frame(i, j == 0 ? FRAME_STDOUT : FRAME_STDERR, NULL, 0, n) < 0)
+        return -1;
+    task_splice[i] = n;
+    task_splice_pipe[i] = j;
+    int ret = out_flush(i);
+    if(ret < 0 || (ret == 0 && pipes_watch(i, 0) < 0))
+        return -1;
+    return n;
+}
+/* read n bytes of the pipe into the queue, they are in it */
+int stream_copy(int i, int j, int n)
+{
+    char *p = out_space(i, n);
+
+    if(p == NULL)
+        return -1;
+    while(n > 0)
+    {
+        ssize_t ret = read(task_pipes[i][j], p, n);
+        if(ret < 0 && errno == EINTR)
+            continue;
+        if(ret <= 0)
+        {
+            perror("stream_copy read");
+            return -1;
+        }
+        task_outq[i].len += ret;
+        p += ret;
+        n -= ret;
+    }
+    return 0;
+}
+/* the client is gone, drop the pipes so that the task gets SIGPIPE */
+void stream_drop(int i)
+{
+    out_reset(i);
+    stream_close(i);
+    if(task_socks[i] > 0)
+        close(task_socks[i]);
+    task_socks[i] = -1;
+}
+void stream_pipe_process(int i, int j, uint32_t events)
+{
+    /* closed by an event before in the same round, or waiting for the client */
+    if(task_pipes[i][j] < 0 || out_busy(i))
+        return;
+    int ret = stream_forward(i, j);
+    if(ret < 0)
+    {
+        stream_drop(i);
+    }
+    else if(ret == 0 && (events & (EPOLLHUP|EPOLLERR)))
+    {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, task_pipes[i][j], NULL);
+        close(task_pipes[i][j]);    /* EOF */
+        task_pipes[i][j] = -1;
+    }
+}
+void rusage_pack(const struct rusage *ru, struct task_rusage *tr)
+{
+    tr->utime_us = ru->ru_utime.tv_sec*1000000LL + ru->ru_utime.tv_usec;
+    tr->stime_us = ru->ru_stime.tv_sec*1000000LL + ru->ru_stime.tv_usec;
+    tr->maxrss_kb = ru->ru_maxrss;
+    tr->minflt = ru->ru_minflt;
+    tr->majflt = ru->ru_majflt;
+    tr->inblock = ru->ru_inblock;
+    tr->oublock = ru->ru_oublock;
+    tr->nvcsw = ru->ru_nvcsw;
+    tr->nivcsw = ru->ru_nivcsw;
+}
+/* the task exited, queue what is in the pipes now and finish with the status.
+   the rest of a frame being spliced is read into the queue, it goes first */
+void stream_finish(int i, int status, const struct rusage *ru)
+{
+    int j, n;
+
+    if(task_splice[i] > 0)
+    {
+        if(stream_copy(i, task_splice_pipe[i], task_splice[i]) < 0)
+        {
+            stream_drop(i);
+            return;
+        }
+        task_splice[i] = 0;
+    }
+    for (j = 0; j < 2; ++j) {
+        int left = 0;
+        if(task_pipes[i][j] >= 0 && ioctl(task_pipes[i][j], FIONREAD, &left) == -1)
+            left = 0;
+        for ( ; left > 0; left -= n) {
+            n = left < FRAME_MAX ? left : FRAME_MAX;
+            metric_add(bytes_forwarded, n);
+            if(out_frame(i, j == 0 ? FRAME_STDOUT : FRAME_STDERR, NULL, 0, n) < 0 || stream_copy(i, j, n) < 0)
+            {
+                stream_drop(i);
+                return;
+            }
+        }
+    }
+    stream_close(i);    /* anything written later by a grandchild is dropped */
+
+    if(task_opts[i].flags & OPT_RUSAGE)
+    {
+        struct task_rusage tr;
+        rusage_pack(ru, &tr);
+        if(out_frame(i, FRAME_RUSAGE, &tr, sizeof tr, sizeof tr) < 0)
+        {
+            stream_drop(i);
+            return;
+        }
+    }
+    int32_t s32 = status;
+    if(out_frame(i, FRAME_STATUS, &s32, sizeof s32, sizeof s32) < 0 || out_flush(i) < 0)
+        stream_drop(i);
+}
+
+/* a PIPE to be cached has its stdout in a pipe, the proxy copies it to the client */
+int capture_prepare(int i, int wr[2])
+{
+    int p[2];
+
+    if(pipe2(p, O_CLOEXEC) == -1)
+    {
+        perror("capture_prepare pipe2");
+        return -1;
+    }
+    task_pipes[i][0] = p[0];
+    wr[0] = p[1];
+    task_captures[i].len = 0;
+    task_captures[i].size = 0;
+    return 0;
+}
+int capture_start(int i)
+{
+    int p = task_pipes[i][0];
+
+    if(fcntl(p, F_SETFL, fcntl(p, F_GETFL, 0) | O_NONBLOCK) == -1)
+    {
+        perror("capture_start fcntl");
+        return -1;
+    }
+    return pipes_watch(i, 1);
+}
+void capture_append(int i, const char data[], int n)
+{
+    struct capture *c = &task_captures[i];
+
+    if(c->len < 0)
+        return;
+    if(c->len + n > CACHE_ENTRY_MAX)
+    {
+        free(c->buf);
+        c->buf = NULL;
+        c->len = -1;
+        return;
+    }
+    if(c->len + n > c->size)
+    {
+        int size = c->size > 0 ? 2*c->size : FRAME_MAX;
+        if(size < c->len + n)
+            size = c->len + n;
+        char *buf = realloc(c->buf, size);
+        if(buf == NULL)
+        {
+            free(c->buf);
+            c->buf = NULL;
+            c->len = -1;
+            return;
+        }
+        c->buf = buf;
+        c->size = size;
+    }
+    memcpy(c->buf + c->len, data, n);
+    c->len += n;
+}
+/* read what is in the pipe into the queue and keep a copy,
+   return the size read, 0 if nothing in the pipe */
+int capture_read(int i)
+{
+    char *p = out_space(i, FRAME_MAX);
+    ssize_t n;
+
+    if(p == NULL)
+        return -1;
+    while((n = read(task_pipes[i][0], p, FRAME_MAX)) < 0 && errno == EINTR)
+        ;
+    if(n <= 0)
+        return 0;
+    metric_add(bytes_forwarded, n);
+    capture_append(i, p, n);
+    task_outq[i].len += n;
+    return n;
+}
+/* move what is in the pipe to the client, the pipe waits if it can't be sent now.
+   return the size moved, 0 if nothing in the pipe, -1 if the client is broken */
+int capture_forward(int i)
+{
+    int n = capture_read(i);
+
+    if(n <= 0)
+        return n;
+    int ret = out_flush(i);
+    if(ret < 0 || (ret == 0 && pipes_watch(i, 0) < 0))
+        return -1;
+    return n;
+}
+void capture_pipe_process(int i, uint32_t events)
+{
+    if(task_pipes[i][0] < 0 || out_busy(i))
+        return;
+    int ret = capture_forward(i);
+    if(ret < 0)
+    {
+        task_captures[i].len = -1;
+        stream_drop(i);
+    }
+    else if(ret == 0 && (events & (EPOLLHUP|EPOLLERR)))
+    {
+        epoll_ctl(epollfd, EPOLL_CTL_DEL, task_pipes[i][0], NULL);
+        close(task_pipes[i][0]);
+        task_pipes[i][0] = -1;
+    }
+}
+/* the task exited, queue what is in the pipe now */
+void capture_finish(int i)
+{
+    int left = 0, n = 0;
+
+    if(task_pipes[i][0] >= 0 && ioctl(task_pipes[i][0], FIONREAD, &left) == -1)
+        left = 0;
+    for ( ; left > 0 && (n = capture_read(i)) > 0; left -= n)
+        ;
+    stream_close(i);
+    if(n < 0 || out_flush(i) < 0)
+    {
+        task_captures[i].len = -1;
+        stream_drop(i);
+    }
+}
+/* keep the result of a task with c=, see c= for what is kept */
+void cache_store(int i, int status)
+{
+    struct capture *c = &task_captures[i];
+
+    if(!WIFEXITED(status) || (status & (TASK_TIMEDOUT|TASK_OOMKILLED)))
+        return;
+    if(task_types[i] == PIPEID)
+    {
+        if(c->len < 0)
+            return;
+        cache_insert(task_cache_key[i], c->buf, c->len, status, task_opts[i].cache_ms);
+        c->buf = NULL;      /* the cache has it */
+    }
+    else
+        cache_insert(task_cache_key[i], NULL, 0, status, task_opts[i].cache_ms);
+}
+/* a hit, replied at once without a task. the reference of e is taken, the
+   output of PIPE is sent from the entry */
+void cache_reply(int i, struct cache_entry *e)
+{
+    int cl = task_socks[i];
+
+    if(task_types[i] == EXECID)
+    {
+        char buf[sizeof RETURN_MARK -1 + sizeof(int32_t)];
+        int32_t s32 = e->status;
+        memcpy(buf, RETURN_MARK, sizeof RETURN_MARK -1);
+        memcpy(buf+sizeof RETURN_MARK -1, &s32, sizeof s32);
+        if(write(cl, buf, sizeof buf) != sizeof buf)    /* the socket is new, it fits */
+            perror("cache_reply write");
+        cache_release(e);
+        return;
+    }
+    struct outq *q = &task_outq[i];
+    q->entry = e;
+    q->buf = e->data;
+    q->len = e->len;
+    q->size = e->len;
+    out_flush(i);
+}
+
+void heap_swap(int a, int b)
+{
+    int t = heap[a];
+    heap[a] = heap[b];
+    heap[b] = t;
+    task_heapidx[heap[a]] = a;
+    task_heapidx[heap[b]] = b;
+}
+void heap_up(int k)
+{
+    while(k > 0 && task_deadline[heap[(k-1)/2]] > task_deadline[heap[k]])
+    {
+        heap_swap(k, (k-1)/2);
+        k = (k-1)/2;
+    }
+}
+void heap_down(int k)
+{
+    while(1)
+    {
+        int c = 2*k+1;
+        if(c >= heap_num)
+            break;
+        if(c+1 < heap_num && task_deadline[heap[c+1]] < task_deadline[heap[c]])
+            c++;
+        if(task_deadline[heap[k]] <= task_deadline[heap[c]])
+            break;
+        heap_swap(k, c);
+        k = c;
+    }
+}
+/* make the timerfd expire at the earliest deadline */
+void timer_arm(void)
+{
+    struct itimerspec its;
+    long long d = heap_num > 0 ? task_deadline[heap[0]] : 0;
+
+    if(d == timer_armed)
+        return;
+    memset(&its, 0, sizeof its);
+    its.it_value.tv_sec = d/1000;
+    its.it_value.tv_nsec = d%1000*1000000;
+    if(timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+    {
+        perror("timer_arm");
+        return;
+    }
+    timer_armed = d;
+}
+void timer_add(int i, long long deadline)
+{
+    task_deadline[i] = deadline;
+    heap[heap_num] = i;
+    task_heapidx[i] = heap_num;
+    heap_up(heap_num++);
+    timer_arm();
+}
+void timer_del(int i)
+{
+    int k = task_heapidx[i];
+    if(k < 0)
+        return;
+    task_heapidx[i] = -1;
+    if(k != --heap_num)
+    {
+        int moved = heap[heap_num];
+        heap[k] = moved;
+        task_heapidx[moved] = k;
+        heap_up(k);
+        heap_down(task_heapidx[moved]);
+    }
+    timer_arm();
+}
+/* ask the spawner to signal the task, the child may be reaped meanwhile */
+void task_kill(int i, int sig)
+{
+    struct spawn_req rq;
+
+    memset(&rq, 0, sizeof rq);
+    rq.reactor = reactor_id;
+    rq.i = i;
+    rq.type = task_types[i];
+    rq.sig = sig;
+    rq.pid = task_pids[i];
+    if(write(spawner_pipe[1], &rq, sizeof rq) != sizeof rq)
+        perror("task_kill write");
+}
+/* SIGTERM at the deadline, SIGKILL if it is still there KILL_GRACE_MS later */
+void timer_process(void)
+{
+    uint64_t n;
+    long long now = now_ms();
+
+    if(read(timer_fd, &n, sizeof n) != sizeof n && errno != EAGAIN)
+        perror("timer_process read");
+    timer_armed = 0;
+    while(heap_num > 0 && task_deadline[heap[0]] <= now)
+    {
+        int i = heap[0];
+        timer_del(i);
+        if(task_pids[i] <= 0)
+            continue;
+        if(task_timedout[i] == 0)
+        {
+            task_kill(i, SIGTERM);
+            task_timedout[i] = 1;
+            timer_add(i, now + KILL_GRACE_MS);
+        }
+        else
+        {
+            task_kill(i, SIGKILL);
+            task_timedout[i] = 2;
+        }
+    }
+    timer_arm();
+}
+
+int ring_reply(int i, int status);
+/* the status of all stages, queued after what the last stage has put in the socket */
+void pipeline_reply(int i)
+{
+    char buf[sizeof RETURN_MARK -1 + (1+STAGE_MAX)*sizeof(int32_t)];
+    int32_t n = ppln_num[i];
+    int k, len = sizeof RETURN_MARK -1;
+
+    memcpy(buf, RETURN_MARK, len);
+    memcpy(buf+len, &n, sizeof n);
+    len += sizeof n;
+    for (k = 0; k < n; ++k) {
+        int32_t s32 = ppln_status[i][k];
+        if(task_timedout[i] && s32 != TASK_NOT_RUN)
+            s32 |= TASK_TIMEDOUT;
+        memcpy(buf+len, &s32, sizeof s32);
+        len += sizeof s32;
+    }
+    if(out_append(i, buf, len) < 0 || out_flush(i) < 0)
+        stream_drop(i);
+}
+/* the task is done, the slot is put when what is queued for the client is sent */
+void task_finish(int i)
+{
+    if(task_socks[i] < 0 || !out_busy(i))
+    {
+        task_put(i);
+        return;
+    }
+    timer_del(i);
+    sched_done(i);
+    task_draining[i] = 1;
+}
+/* EPOLLOUT of a client, go on with what is queued */
+void client_writable(int i, uint32_t events)
+{
+    if(!task_outwatch[i])   /* put by an event before in the same round */
+        return;
+    int ret = out_flush(i);
+    if(ret == 0 && (events & (EPOLLHUP|EPOLLERR)))
+    {
+        out_reset(i);
+        ret = -1;
+    }
+    if(ret == 0)
+        return;
+    if(task_draining[i])
+        task_put(i);
+    else if(ret < 0 && batches[i].total >= 0)
+        batches[i].broken = 1;      /* the items running are left to finish */
+    else if(ret < 0)
+    {
+        task_captures[i].len = -1;
+        stream_drop(i);
+    }
+    else if(pipes_watch(i, 1) < 0)  /* the pipes go on */
+    {
+        task_captures[i].len = -1;
+        stream_drop(i);
+    }
+}
+void after_wait(int i, pid_t pid, int status, const struct rusage *ru)
+{
+    pid_count--;
+    if(task_pids[i] == pid)
+    {
+        if(task_timedout[i])
+        {
+            status |= TASK_TIMEDOUT;
+            metric_add(timedout, 1);
+        }
+        if(task_types[i] == STRMID)
+        {
+            if(task_socks[i] > 0)
+                stream_finish(i, status, ru);
+        }
+        else if(task_types[i] == PPLNID)
+        {
+            if(task_socks[i] > 0)
+                pipeline_reply(i);
+        }
+        else if(task_types[i] == PIPEID)
+        {
+            if(task_socks[i] > 0)   /* its output is cached */
+                capture_finish(i);
+        }
+        else if(task_socks[i] > 0 && ((task_opts[i].flags & OPT_RUSAGE) || !use_uring || ring_reply(i, status) < 0))
+        {
+            char buf[sizeof RETURN_MARK -1 + sizeof(int32_t) + sizeof(struct task_rusage)];
+            int32_t s32 = status;
+            int n = sizeof RETURN_MARK -1 + sizeof s32;
+            memcpy(buf, RETURN_MARK, sizeof RETURN_MARK -1);
+            memcpy(buf+sizeof RETURN_MARK -1, &s32, sizeof s32);
+            if(task_opts[i].flags & OPT_RUSAGE)     /* only EXEC still has the socket */
+            {
+                struct task_rusage tr;
+                rusage_pack(ru, &tr);
+                memcpy(buf+n, &tr, sizeof tr);
+                n += sizeof tr;
+            }
+            int ret = write(task_socks[i], buf, n);
+            if(ret < 0)
+                perror("after_wait write");
+        }
+        if(task_opts[i].cache_ms > 0)
+            cache_store(i, status);
+        if(batch_parent[i] >= 0)
+            batch_item_done(i, status, ru);
+        task_finish(i);
+    }
+    else
+        fprintf(stderr, "pid %d not found\n", pid);
+}
+/* a stage exited, the task is done with the last */
+void pipeline_exited(int i, int stage, pid_t pid, int status, const struct rusage *ru)
+{
+    if(task_types[i] != PPLNID || task_pids[i] <= 0 || stage >= ppln_num[i])
+    {
+        fprintf(stderr, "pid %d not found\n", pid);
+        return;
+    }
+    ppln_status[i][stage] = status;
+    if(--ppln_left[i] == 0)
+        after_wait(i, task_pids[i], status, ru);
+}
+
+int client_readbuf(int cl, char buf[], int size)
+{
+    int l = 0;
+    int ret;
+
+    if(size <= 0)
+    {
+        fprintf(stderr, "request too long\n");
+        return -1;
+    }
+
+    while(size - l > 0)
+    {
+        ret = read(cl, buf+l, size-l);
+        if(ret < 0)
+        {
+            if(errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                perror("client_readbuf read");
+                return -1;
+            }
+            break;
+        }
+        else if(ret == 0)       /* EOF */
+            break;
+        else
+            l += ret;
+    }
+    if(ret == 0 && l+1 <= size && l-1 >= 0 &&buf[l-1] != 0)
+        buf[l++] = 0;    /* must end with 0, append one if not exist */
+
+    if(size-l == 0 && buf[l-1] != 0)
+    {
+        fprintf(stderr, "request too long\n");
+        return -1;
+    }
+    return l;
+}
+
+void task_spawn(int i, char buf[], int l);
+/* the slots kept from new clients, one for each batch with no item running */
+int batch_reserved(void)
+{
+    int p, n = 0;
+    for (p = 0; p < MAX_TASKS && batch_num > 0; ++p) {
+        struct batch *b = &batches[p];
+        if(b->total >= 0 && !b->broken && b->started < b->total && b->started == b->done)
+            n++;
+    }
+    return n;
+}
+int sched_admit(int c)
+{
+    return run_num < run_max && class_running[c] < class_cap[c];
+}
+/* move a request out of its slot into the queue of its flow, -1 if it is refused */
+int sched_enqueue(int i, char buf[], int l)
+{
+    int c = task_class[i];
+    int f = class_flow[c];
+    struct pending *q;
+
+    if(f >= 0)
+    {
+        do
+        {
+            if(flow_uid[f] == task_uid[i])
+                break;
+            f = flow_next[f];
+        } while(f != class_flow[c]);
+        if(flow_uid[f] != task_uid[i])
+            f = -1;
+    }
+    if(pending_num >= PENDING_MAX || (q = malloc(sizeof *q + l)) == NULL)
+        return -1;
+    if(f < 0)           /* a new flow, put it next to be served */
+    {
+        f = flow_free;
+        flow_free = flow_next[f];
+        flow_uid[f] = task_uid[i];
+        flow_head[f] = NULL;
+        if(class_flow[c] < 0)
+        {
+            flow_next[f] = f;
+            class_flow[c] = f;
+        }
+        else
+        {
+            flow_next[f] = flow_next[class_flow[c]];
+            flow_next[class_flow[c]] = f;
+        }
+    }
+    q->next = NULL;
+    q->sock = task_socks[i];
+    q->type = task_types[i];
+    q->cls = c;
+    q->stages = ppln_num[i];
+    q->uid = task_uid[i];
+    q->opt = task_opts[i];
+    q->cache_key = task_cache_key[i];
+    q->t_accept = task_t_accept[i];
+    q->t_request = task_t_request[i];
+    q->len = l;
+    memcpy(q->buf, buf, l);
+    if(flow_head[f] == NULL)
+        flow_head[f] = q;
+    else
+        flow_tail[f]->next = q;
+    flow_tail[f] = q;
+    pending_num++;
+    class_pending[c]++;
+    metric_add(pending, 1);
+
+    task_socks[i] = -1;     /* kept open by the queue */
+    task_put(i);
+    return 0;
+}
+/* take a request from the current flow of c into slot i and move to the next flow */
+void sched_dequeue(int c, int i)
+{
+    int f = class_flow[c];
+    struct pending *q = flow_head[f];
+
+    flow_head[f] = q->next;
+    if(flow_head[f] != NULL)
+    {
+        class_flow[c] = flow_next[f];
+    }
+    else if(flow_next[f] == f)      /* the last flow */
+    {
+        class_flow[c] = -1;
+        flow_next[f] = flow_free;
+        flow_free = f;
+    }
+    else
+    {
+        int prev = f;
+        while(flow_next[prev] != f)
+            prev = flow_next[prev];
+        flow_next[prev] = flow_next[f];
+        class_flow[c] = flow_next[f];
+        flow_next[f] = flow_free;
+        flow_free = f;
+    }
+    pending_num--;
+    class_pending[c]--;
+    metric_add(pending, -1);
+
+    task_socks[i] = q->sock;
+    task_types[i] = q->type;
+    task_class[i] = q->cls;
+    ppln_num[i] = q->stages;
+    task_uid[i] = q->uid;
+    task_opts[i] = q->opt;
+    task_cache_key[i] = q->cache_key;
+    task_t_accept[i] = q->t_accept;
+    task_t_request[i] = q->t_request;
+    task_keepbuf(i, q->buf, q->len);
+    free(q);
+}
+/* spawn pending tasks while the caps and the slots allow, called every loop */
+void sched_run(void)
+{
+    int skipped = 0;
+
+    while(skipped < CLASS_NUM && run_num < run_max)
+    {
+        int c = sched_class;
+        if(class_pending[c] == 0 || class_running[c] >= class_cap[c])
+        {
+            if(class_pending[c] == 0)
+                class_deficit[c] = 0;
+            sched_class = (c+1)%CLASS_NUM;
+            skipped++;
+            continue;
+        }
+        int i = task_get();
+        if(i < 0)       /* again when a slot is put */
+            return;
+        if(class_deficit[c] <= 0)
+            class_deficit[c] += class_quantum[c];
+        sched_dequeue(c, i);
+        if(--class_deficit[c] <= 0)
+            sched_class = (c+1)%CLASS_NUM;
+        skipped = 0;
+
+        struct taskbuf *data = task_getbuf(i);
+        task_spawn(i, data->buf, data->len);
+    }
+}
+
+/* answered at once, the socket is new so the reply fits in it */
+void stat_reply(int i)
+{
+    char out[STAT_MAX];
+    int n = metrics_format(out, sizeof out, task_opts[i].flags & OPT_JSON);
+    if(write(task_socks[i], out, n) != n)
+        perror("stat_reply write");
+}
+
+void batch_finish(int p)
+{
+    struct batch *b = &batches[p];
+    int32_t v[2] = {b->total, b->failed};
+
+    if(!b->broken && out_frame(p, FRAME_STATUS, v, sizeof v, sizeof v) == 0)
+        out_flush(p);
+    task_finish(p);
+}
+/* the items start in batch_run, the request is kept in the slot until the end */
+void batch_start(int i, char buf[], int l)
+{
+    struct batch *b = &batches[i];
+    struct taskbuf *data = task_keepbuf(i, buf, l);
+    int pos, n;
+
+    if(batch_num >= BATCH_MAX)
+    {
+        task_put(i);
+        fprintf(stderr, "too many batches, %d at most\n", BATCH_MAX);
+        return;
+    }
+    const char *first = memchr(data->buf, DELIM, data->len);
+    b->pos = first != NULL ? first - data->buf : data->len;
+    b->total = 0;
+    for (pos = b->pos; request_line(data->buf, data->len, &pos, &n) >= 0; )
+        b->total++;
+    b->started = 0;
+    b->done = 0;
+    b->failed = 0;
+    b->broken = 0;
+    batch_num++;
+    if(b->total == 0)
+        batch_finish(i);
+}
+/* take a slot for the next item and run it, batch_run waits for the caps */
+void batch_item_start(int p)
+{
+    struct batch *b = &batches[p];
+    struct taskbuf *data = task_getbuf(p);
+    int n, at = request_line(data->buf, data->len, &b->pos, &n);
+    int k = task_get();
+
+    struct taskbuf *item = task_getbuf(k);
+    item->len = request_line_copy(item->buf, data->buf + at, n);
+
+    task_types[k] = EXECID;
+    task_opts[k] = task_opts[p];
+    task_uid[k] = task_uid[p];
+    task_class[k] = task_class[p];
+    task_t_request[k] = now_us();
+    batch_parent[k] = p;
+    batch_index[k] = b->started++;
+    task_spawn(k, item->buf, item->len);
+}
+/* start the items while the batches, the slots and the caps allow, called
+   every loop. the items wait in the batch, behind the pending requests of the
+   class. a batch with no item running may take the last slots, see batch_reserved */
+void batch_run(void)
+{
+    int p;
+    for (p = 0; p < MAX_TASKS && batch_num > 0; ++p) {
+        struct batch *b = &batches[p];
+        int c = task_class[p];
+        while(b->total >= 0 && b->started < b->total && !b->broken
+                && (task_opts[p].limit < 0 || b->started - b->done < task_opts[p].limit)
+                && class_pending[c] == 0 && sched_admit(c)
+                && (task_count < MAX_TASKS - BATCH_RESERVE || (b->started == b->done && task_count < MAX_TASKS)))
+            batch_item_start(p);
+    }
+}
+/* an item exited or is not run, tell the client */
+void batch_item_done(int k, int status, const struct rusage *ru)
+{
+    int p = batch_parent[k];
+    struct batch *b = &batches[p];
+    char buf[2*sizeof(int32_t) + sizeof(struct task_rusage)];
+    int32_t v[2] = {batch_index[k], status};
+    int n = sizeof v;
+
+    batch_parent[k] = -1;
+    b->done++;
+    if(status != 0)
+        b->failed++;
+    memcpy(buf, v, sizeof v);
+    if(task_opts[p].flags & OPT_RUSAGE)
+    {
+        struct task_rusage tr;
+        memset(&tr, 0, sizeof tr);
+        if(ru != NULL)
+            rusage_pack(ru, &tr);
+        memcpy(buf+n, &tr, sizeof tr);
+        n += sizeof tr;
+    }
+    if(!b->broken && (out_frame(p, FRAME_ITEM, buf, n, n) < 0 || out_flush(p) < 0))
+        b->broken = 1;      /* the items running are left to finish */
+    if(b->done == b->started && (b->started == b->total || b->broken))
+        batch_finish(p);
+}
+/* the stages of a pipeline, 0 if none or too many */
+int pipeline_count(const char buf[], int l)
+{
+    const char *first = memchr(buf, DELIM, l);
+    int pos, n, num = 0;
+
+    if(first == NULL)
+        return 0;
+    for (pos = first - buf; request_line(buf, l, &pos, &n) >= 0; )
+        num++;
+    return num <= STAGE_MAX ? num : 0;
+}
+/* 1 if a PIPE has a filter line after the command and nothing else */
+int pipe_filtered(const char buf[], int l)
+{
+    char line[REQUESTBUF_SIZE], name[EXE_NAME_MAX];
+    const char *first = memchr(buf, DELIM, l);
+    int pos, n, at;
+
+    if(first == NULL)
+        return 0;
+    pos = first - buf;
+    if(request_line(buf, l, &pos, &n) < 0 || (at = request_line(buf, l, &pos, &n)) < 0)
+        return 0;
+    n = request_line_copy(line, buf+at, n);
+    return request_cmd(line, n, name, sizeof name) > 0 && strcmp(name, "filter") == 0
+        && request_line(buf, l, &pos, &n) < 0;
+}
+void client_after_read(int i, char buf[], int l)
 {
     int cl = task_socks[i];
     if(l < CMDLEN+1)
@@ -271,7 +2799,7 @@ void client_after_read(int i, char buf[], int l)
     ev.events = EPOLLERR;
     ev.data.fd = cl;
     */
-    if(epoll_ctl(epollfd, EPOLL_CTL_DEL, cl, NULL) == -1)
+    if(!use_uring && epoll_ctl(epollfd, EPOLL_CTL_DEL, cl, NULL) == -1)
     {
         perror("client_after_read epoll_ctl");
         task_put(i);
@@ -293,132 +2821,854 @@ void client_after_read(int i, char buf[], int l)
         type = NRETID;
     else if(strncmp(buf, PIPE, CMDLEN) == 0)
         type = PIPEID;
+    else if(strncmp(buf, STRM, CMDLEN) == 0)
+        type = STRMID;
+    else if(strncmp(buf, STAT, CMDLEN) == 0)
+        type = STATID;
+    else if(strncmp(buf, BTCH, CMDLEN) == 0)
+        type = BTCHID;
+    else if(strncmp(buf, PPLN, CMDLEN) == 0)
+        type = PPLNID;
     else
+        type = -1;
+    if(type < 0 || parse_options(buf, l, &task_opts[i]) < 0)
     {
         buf[l-1] = 0;
         task_put(i);
         fprintf(stderr, "wrong request(print without last byte):%s\n", buf);
         return;
     }
+    int filtered = type == PIPEID && pipe_filtered(buf, l);
+    if(filtered)        /* run as a pipeline, replied like PIPE */
+    {
+        type = PPLNID;
+        task_opts[i].flags |= OPT_OUTPUT|OPT_NOSTATUS;
+    }
+    if(type == PPLNID && (ppln_num[i] = pipeline_count(buf, l)) == 0)
+    {
+        buf[l-1] = 0;
+        task_put(i);
+        fprintf(stderr, "wrong pipeline, 1 to %d stages(print without last byte):%s\n", STAGE_MAX, buf);
+        return;
+    }
+    task_types[i] = type;
+    task_t_request[i] = now_us();
+    hist_add(H_READ, task_t_request[i] - task_t_accept[i]);
+    metric_add(requests[filtered ? PIPEID : type], 1);
+    if(type == STATID)
+    {
+        stat_reply(i);
+        task_put(i);
+        return;
+    }
+    if(task_opts[i].cache_ms > 0)
+    {
+        if((type != EXECID && type != PIPEID) || (task_opts[i].flags & OPT_RUSAGE) || cache_max <= 0)
+            task_opts[i].cache_ms = 0;
+        else
+        {
+            task_cache_key[i] = cache_key(type, buf, l);
+            struct cache_entry *e = cache_lookup(task_cache_key[i]);
+            if(e != NULL)
+            {
+                metric_add(cache_hits, 1);
+                cache_reply(i, e);
+                task_finish(i);
+                return;
+            }
+            metric_add(cache_misses, 1);
+        }
+    }
 
-    pid_t pid = fork();
-    if(pid < 0)
+    int c = task_opts[i].prio;
+    if(c < 0)
+        c = type == NRETID ? CLASS_BATCH : type == BTCHID ? CLASS_NORMAL : CLASS_INTERACTIVE;
+    task_class[i] = c;
+    if(type == BTCHID)
+    {
+        batch_start(i, buf, l);
+        return;
+    }
+    if(class_pending[c] == 0 && sched_admit(c))
+    {
+        task_spawn(i, buf, l);
+        return;
+    }
+
+    /* wait in the queue */
+    if(type == NRETID)  /* it returns now, the fd is kept for the child */
+        shutdown(cl, SHUT_WR);
+    if(sched_enqueue(i, buf, l) < 0)
+    {
+        task_put(i);
+        fprintf(stderr, "too many pending requests, %d at most\n", PENDING_MAX);
+    }
+}
+/* a name too long for the cache is searched by the child, if it is allowed */
+int request_allowed(const char buf[], int l)
+{
+    char name[EXE_NAME_MAX];
+    int n = request_cmd(buf, l, name, sizeof name);
+    return n >= 0 && (n < sizeof name ? allow_check(name) : allow_num == 0);
+}
+int pipeline_allowed(const char buf[], int l)
+{
+    char stage[REQUESTBUF_SIZE];
+    const char *first = memchr(buf, DELIM, l);     /* there, see pipeline_count */
+    int pos = first - buf, n, at;
+
+    while((at = request_line(buf, l, &pos, &n)) >= 0)
+    {
+        if(!request_allowed(stage, request_line_copy(stage, buf+at, n)))
+            return 0;
+    }
+    return 1;
+}
+/* hand the task to the spawner, the reply comes to spawn_event_process */
+void task_spawn(int i, char buf[], int l)
+{
+    struct spawn_req rq;
+    int type = task_types[i];
+
+    if(!(type == PPLNID ? pipeline_allowed(buf, l) : request_allowed(buf, l)))
+    {
+        buf[l-1] = 0;
+        task_put(i);
+        fprintf(stderr, "request not allowed(print without last byte):%s\n", buf);
+        return;
+    }
+
+    struct taskbuf *data = task_keepbuf(i, buf, l);
+    rq.wr[0] = rq.wr[1] = -1;
+    if((type == STRMID && stream_prepare(i, rq.wr) < 0)
+            || (type == PIPEID && task_opts[i].cache_ms > 0 && capture_prepare(i, rq.wr) < 0))
+    {
+        task_put(i);
+        return;
+    }
+    rq.reactor = reactor_id;
+    rq.i = i;
+    rq.type = type;
+    rq.cl = task_socks[i];
+    if(rq.cl < 0)       /* an item, the child closes the client of its batch at once */
+        rq.cl = task_socks[batch_parent[i]];
+    if(type == PIPEID && rq.wr[0] >= 0)     /* cached, the output goes to the proxy */
+        rq.cl = rq.wr[0];
+    rq.buf = data->buf;
+    rq.len = data->len;
+    rq.cls = task_class[i];
+    rq.flags = task_opts[i].flags;
+    rq.t_request = task_t_request[i];
+    rq.sig = 0;
+    if(write(spawner_pipe[1], &rq, sizeof rq) != sizeof rq)
+    {
+        perror("task_spawn write");
+        if(rq.wr[0] >= 0)
+            close(rq.wr[0]);
+        if(rq.wr[1] >= 0)
+            close(rq.wr[1]);
+        metric_add(spawn_failed, 1);
+        task_put(i);
+        return;
+    }
+    task_pids[i] = 0;   /* not free, the pid is not known yet */
+    task_state[i] = SCHED_RUNNING;
+    class_running[task_class[i]]++;
+    run_num++;
+    metric_add(running, 1);
+}
+/* the spawner has started the task, stages is of a pipeline */
+void task_spawned(int i, pid_t pid, int stages)
+{
+    int k;
+    pid_count++;
+    task_freebuf(i);
+    task_pids[i] = pid;
+    int timeout = task_opts[i].timeout_ms >= 0 ? task_opts[i].timeout_ms : default_timeout_ms;
+    if(timeout > 0)
+        timer_add(i, now_ms() + timeout);
+    switch(task_types[i])
+    {
+        case EXECID:
+            /* close it after wait to write the status of the child to the client */
+            break;
+        case PPLNID:
+            for (k = 0; k < ppln_num[i]; ++k)
+                ppln_status[i][k] = TASK_NOT_RUN;
+            ppln_left[i] = stages;
+            if(task_opts[i].flags & OPT_NOSTATUS)   /* like PIPE, the stages have it */
+            {
+                close(task_socks[i]);
+                task_socks[i] = -1;
+            }
+            break;
+        case STRMID:
+            if(stream_start(i) < 0)
+                stream_drop(i);
+            break;
+        case PIPEID:
+            if(task_pipes[i][0] >= 0)   /* cached, the output is copied by the proxy */
+            {
+                if(capture_start(i) < 0)
+                {
+                    task_captures[i].len = -1;
+                    stream_drop(i);
+                }
+                break;
+            }
+        case NRETID:
+            close(task_socks[i]);
+            task_socks[i] = -1;
+    }
+}
+void spawn_event_process(void)
+{
+    struct spawn_ev ev;
+
+    while(read(reactor_pipes[reactor_id][0], &ev, sizeof ev) == sizeof ev)
+    {
+        switch(ev.what)
+        {
+            case SPAWN_OK:
+                task_spawned(ev.i, ev.pid, ev.status);
+                break;
+            case SPAWN_FAILED:
+                task_put(ev.i);
+                break;
+            case SPAWN_EXITED:
+                if(ev.stage >= 0)
+                    pipeline_exited(ev.i, ev.stage, ev.pid, ev.status, &ev.ru);
+                else
+                    after_wait(ev.i, ev.pid, ev.status, &ev.ru);
+                break;
+        }
+    }
+}
+void client_process(int i)
+{
+    int cl = task_socks[i];
+    struct taskbuf *buf = task_getbuf(i);     /* read in place, mostly all at once */
+    int l = client_readbuf(cl, &buf->buf[buf->len], REQUESTBUF_SIZE - buf->len);
+    if(l < 0 || (l == 0 && buf->len == 0))
+    {
+        task_put(i);
+        return;
+    }
+    if(l == 0 && buf->len < REQUESTBUF_SIZE)
+    {
+        buf->buf[buf->len] = 0;
+        buf->len ++;
+    }
+    buf->len += l;
+    if(buf->buf[buf->len - 1] != 0)
+    {
+        return;
+    }
+    client_after_read(i, buf->buf, buf->len);
+}
+
+/* the identity of the client, for the scheduler */
+int client_accepted(int i)
+{
+    int cl = task_socks[i];
+    struct ucred cred;
+    socklen_t len = sizeof cred;
+    if(getsockopt(cl, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+    {
+        perror("client_accepted getsockopt");
+        task_put(i);
+        return -1;
+    }
+    task_uid[i] = cred.uid;
+    task_t_accept[i] = now_us();
+    metric_add(accepted, 1);
+    return 0;
+}
+void server_sock_process(int fd)
+{
+    int i;
+
+    if(task_count + batch_reserved() >= MAX_TASKS || (i = task_get()) < 0)
+    {
+        listen_pause();
+        return;
+    }
+
+    /* close on exec, the spawner forks while the reactors run */
+    int cl = accept4(fd, NULL, NULL, SOCK_NONBLOCK|SOCK_CLOEXEC);
+    if(cl < 0)
+    {
+        if(errno != EAGAIN)     /* taken by another reactor */
+            perror("accept");
+        task_put(i);
+        return;
+    }
+    task_socks[i] = cl;
+    if(client_accepted(i) < 0)
+        return;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = -i;    /* fd is saved in task_socks[i], use negative num to not conflict with normal fd */
+    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, cl, &ev) == -1) {
+        perror("server_sock_process epoll_ctl");
+        task_put(i);
+        return;
+    }
+}
+/*
+ * the io_uring backend of a reactor, by -u. the ring takes the sockets of
+ * clients: a multishot accept, receives into buffers provided to the ring and
+ * the status of EXEC written and closed by a linked send and close, so most
+ * of them cost no syscall but the io_uring_enter of a loop. the ring fd is
+ * watched by the epoll of the reactor, the pipes and the timer stay there.
+ */
+enum
+{
+    RING_ACCEPT,
+    RING_RECV,
+    RING_PROVIDE,
+    RING_SEND,
+    RING_CLOSE,
+    RING_CANCEL,
+};
+#define ring_data(op, i)    ((uint64_t)(op) << 32 | (uint32_t)(i))
+struct ring
+{
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    unsigned sq_entries;
+    unsigned sq_local;      /* the tail not published yet */
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    char *sq;
+    size_t sq_size;
+    int accepting;          /* until the multishot accept ends */
+    int cancelled;
+    int *waiting;           /* accepted when the slots are all taken */
+    int wait_num, wait_max; /* grows, the accept goes on until the cancel is done */
+    char *bufs;             /* MAX_TASKS provided buffers of REQUESTBUF_SIZE */
+    char replies[REPLY_MAX][sizeof RETURN_MARK -1 + sizeof(int32_t)];
+    int reply_free[REPLY_MAX];
+    int reply_num;
+};
+__thread struct ring ring;
+
+int ring_setup(void)
+{
+    struct io_uring_params p;
+    int k;
+
+    memset(&p, 0, sizeof p);
+    ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &p);
+    if(ring.fd < 0)
+        return -1;
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP))
+    {
+        errno = ENOSYS;
+        return -1;
+    }
+
+    size_t sq_size = p.sq_off.array + p.sq_entries*sizeof(unsigned);
+    size_t cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+    if(cq_size > sq_size)
+        sq_size = cq_size;      /* one mmap for both, IORING_FEAT_SINGLE_MMAP */
+    char *sq = mmap(NULL, sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+    if(sq == MAP_FAILED)
+        return -1;
+    ring.sq = sq;
+    ring.sq_size = sq_size;
+    ring.sqes = mmap(NULL, p.sq_entries*sizeof(struct io_uring_sqe), PROT_READ|PROT_WRITE,
+            MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+    if(ring.sqes == MAP_FAILED)
+        return -1;
+    ring.sq_head = (unsigned *)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned *)(sq + p.sq_off.array);
+    ring.sq_entries = p.sq_entries;
+    ring.sq_local = *ring.sq_tail;
+    ring.cq_head = (unsigned *)(sq + p.cq_off.head);
+    ring.cq_tail = (unsigned *)(sq + p.cq_off.tail);
+    ring.cq_mask = (unsigned *)(sq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe *)(sq + p.cq_off.cqes);
+
+    ring.bufs = aligned_alloc(CACHELINE, MAX_TASKS*REQUESTBUF_SIZE);
+    if(ring.bufs == NULL)
+        return -1;
+    for (k = 0; k < REPLY_MAX; ++k) {
+        ring.reply_free[k] = k;
+    }
+    ring.reply_num = REPLY_MAX;
+    return 0;
+}
+void ring_free(void)
+{
+    if(ring.sq != NULL)
+        munmap(ring.sq, ring.sq_size);
+    if(ring.sqes != NULL && ring.sqes != MAP_FAILED)
+        munmap(ring.sqes, ring.sq_entries*sizeof(struct io_uring_sqe));
+    if(ring.fd >= 0)
+        close(ring.fd);
+    free(ring.bufs);
+    memset(&ring, 0, sizeof ring);
+    ring.fd = -1;
+}
+int ring_submit(void)
+{
+    unsigned n = ring.sq_local - *ring.sq_tail;
+
+    if(n == 0)
+        return 0;
+    __atomic_store_n(ring.sq_tail, ring.sq_local, __ATOMIC_RELEASE);
+    if(syscall(__NR_io_uring_enter, ring.fd, n, 0, 0, NULL, 0) < 0)
+    {
+        perror("ring_submit");
+        return -1;
+    }
+    return 0;
+}
+struct io_uring_sqe *ring_sqe(int op, uint64_t data)
+{
+    if(ring.sq_local - __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) == ring.sq_entries)
+        ring_submit();  /* full, the kernel consumes them in enter */
+
+    unsigned k = ring.sq_local & *ring.sq_mask;
+    struct io_uring_sqe *sqe = &ring.sqes[k];
+    memset(sqe, 0, sizeof *sqe);
+    sqe->opcode = op;
+    sqe->user_data = data;
+    ring.sq_array[k] = k;
+    ring.sq_local++;
+    return sqe;
+}
+void ring_provide(int bid, int n)
+{
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_PROVIDE_BUFFERS, ring_data(RING_PROVIDE, bid));
+    sqe->addr = (uintptr_t)(ring.bufs + bid*REQUESTBUF_SIZE);
+    sqe->len = REQUESTBUF_SIZE;
+    sqe->fd = n;
+    sqe->off = bid;
+    sqe->buf_group = 0;
+}
+void ring_accept(void)
+{
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_ACCEPT, ring_data(RING_ACCEPT, 0));
+    sqe->fd = server_sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;   /* blocking, the ring waits for us */
+    ring.accepting = 1;
+}
+void ring_recv(int i)
+{
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_RECV, ring_data(RING_RECV, i));
+    sqe->fd = task_socks[i];
+    sqe->len = REQUESTBUF_SIZE;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+}
+/* write the status and close the socket by the ring, the slot is free at once */
+int ring_reply(int i, int status)
+{
+    if(ring.reply_num == 0)
+        return -1;
+    int k = ring.reply_free[--ring.reply_num];
+    int32_t s32 = status;
+    memcpy(ring.replies[k], RETURN_MARK, sizeof RETURN_MARK -1);
+    memcpy(ring.replies[k]+sizeof RETURN_MARK -1, &s32, sizeof s32);
+
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_SEND, ring_data(RING_SEND, k));
+    sqe->fd = task_socks[i];
+    sqe->addr = (uintptr_t)ring.replies[k];
+    sqe->len = sizeof ring.replies[k];
+    sqe->msg_flags = MSG_NOSIGNAL;
+    sqe->flags = IOSQE_IO_HARDLINK;     /* closed even if the client is gone */
+    sqe = ring_sqe(IORING_OP_CLOSE, ring_data(RING_CLOSE, 0));
+    sqe->fd = task_socks[i];
+    task_socks[i] = -1;     /* the ring owns it */
+    return 0;
+}
+/*
+ * the backend needs IORING_FEAT_SINGLE_MMAP (5.4), the ops below (5.7 for
+ * PROVIDE_BUFFERS) and the multishot accept (5.19), which is not in the probe
+ * of the ops, so one is tried on a socket of its own. 0 if all are there.
+ */
+int ring_probe(void)
+{
+    static const int ops[] = {IORING_OP_ACCEPT, IORING_OP_RECV, IORING_OP_SEND,
+        IORING_OP_CLOSE, IORING_OP_PROVIDE_BUFFERS, IORING_OP_ASYNC_CANCEL};
+    int k, ret = -1;
+    int s = -1, c = -1;
+    struct io_uring_probe *probe = calloc(1, sizeof *probe + IORING_OP_LAST*sizeof(struct io_uring_probe_op));
+
+    ring.fd = -1;
+    if(probe == NULL || ring_setup() < 0)
+        goto out;
+    if(syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE, probe, IORING_OP_LAST) < 0)
+        goto out;
+    for (k = 0; k < sizeof ops/sizeof ops[0]; ++k) {
+        if(ops[k] >= probe->ops_len || !(probe->ops[ops[k]].flags & IO_URING_OP_SUPPORTED))
+        {
+            errno = ENOSYS;
+            goto out;
+        }
+    }
+
+    struct sockaddr_un addr;
+    socklen_t len = sizeof(sa_family_t);    /* an abstract name chosen by the kernel */
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    s = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    c = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if(s < 0 || c < 0 || bind(s, (struct sockaddr *)&addr, len) == -1 || listen(s, 1) == -1)
+        goto out;
+    len = sizeof addr;
+    if(getsockname(s, (struct sockaddr *)&addr, &len) == -1 || connect(c, (struct sockaddr *)&addr, len) == -1)
+        goto out;
+    struct io_uring_sqe *sqe = ring_sqe(IORING_OP_ACCEPT, ring_data(RING_ACCEPT, 0));
+    sqe->fd = s;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    if(ring_submit() < 0 || syscall(__NR_io_uring_enter, ring.fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0)
+        goto out;
+    struct io_uring_cqe *cqe = &ring.cqes[*ring.cq_head & *ring.cq_mask];
+    if(cqe->res >= 0)
+        close(cqe->res);
+    if(cqe->res < 0 || !(cqe->flags & IORING_CQE_F_MORE))
+    {
+        errno = cqe->res < 0 ? -cqe->res : EINVAL;  /* EINVAL before 5.19 */
+        goto out;
+    }
+    ret = 0;
+out:
+    k = errno;
+    if(s >= 0)
+        close(s);
+    if(c >= 0)
+        close(c);
+    ring_free();
+    free(probe);
+    errno = k;
+    return ret;
+}
+/* take a slot for an accepted socket and start to receive */
+int ring_client(int cl)
+{
+    int i;
+    if(task_count + batch_reserved() >= MAX_TASKS || (i = task_get()) < 0)
+        return -1;
+    task_socks[i] = cl;
+    if(client_accepted(i) == 0)
+        ring_recv(i);
+    return 0;
+}
+/* the same as client_process, but the data is received by the ring */
+void ring_client_recv(int i, char data[], int n)
+{
+    struct taskbuf *buf = task_getbuf(i);
+
+    if(n < 0)
     {
         task_put(i);
-        perror("client_after_read fork");
         return;
     }
-    else if(pid > 0)    /* parent */
+    if(buf->len == 0 && n > 0 && data[n-1] == 0)  /* mostly, all in one */
     {
-        pid_count++;
-        task_freebuf(i);
-        task_pids[i] = pid;
-        switch(type)
-        {
-            case EXECID:
-                /* close it after wait to write the status of the child to the client */
-                break;
-            case NRETID:
-            case PIPEID:
-                close(task_socks[i]);
-                task_socks[i] = -1;
-        }
+        client_after_read(i, data, n);
         return;
     }
-    else                /* child,  exec, no return */
+    if(n == 0)      /* EOF, must end with 0, append one */
     {
-        switch(type)
+        if(buf->len == 0 || buf->len == REQUESTBUF_SIZE)
         {
-            case EXECID:
-            case NRETID:
-                exec_process(cl, type, buf, l);
-            case PIPEID:
-                pipe_process(cl, type, buf, l);
+            task_put(i);
+            return;
         }
+        buf->buf[buf->len++] = 0;
     }
-}
-void client_process(int i)
-{
-    int cl = task_socks[i];
-    struct taskbuf *buf = task_getbuf(i);
-    if(buf == NULL)     /* mostly, in stack is enough */
+    else
     {
-        char _buf[REQUESTBUF_SIZE];
-        int l = client_readbuf(cl, _buf, REQUESTBUF_SIZE);
-        if(l <= 0)
+        if(buf->len + n > REQUESTBUF_SIZE)
         {
+            fprintf(stderr, "request too long\n");
             task_put(i);
             return;
         }
-        if(_buf[l-1] != 0)
-        {
-            struct taskbuf *data = task_allocbuf(i);
-            if(data == NULL || REQUESTBUF_SIZE < l)
+        memcpy(&buf->buf[buf->len], data, n);
+        buf->len += n;
+    }
+    if(buf->buf[buf->len - 1] != 0)
+    {
+        ring_recv(i);
+        return;
+    }
+    client_after_read(i, buf->buf, buf->len);
+}
+void ring_cqe(uint64_t data, int res, unsigned flags)
+{
+    int i = (uint32_t)data;
+
+    switch(data >> 32)
+    {
+        case RING_ACCEPT:
+            if(!(flags & IORING_CQE_F_MORE))
             {
-                task_put(i);
-                return;
+                ring.accepting = 0;     /* armed again by ring_prepare */
+                ring.cancelled = 0;
             }
-            memcpy(data->buf, _buf, l);    /* copy from stack to heap */
-            data->len = l;
-            return;
-        }
-        return client_after_read(i, _buf, l);
+            if(res == -EINVAL)      /* not able to accept, armed again would spin */
+            {
+                errno = -res;
+                error_exist("ring accept");
+            }
+            if(res < 0)
+            {
+                if(res != -ECANCELED)
+                    fprintf(stderr, "ring accept: %s\n", strerror(-res));
+                break;
+            }
+            if(ring.wait_num > 0 || ring_client(res) < 0)
+            {
+                if(ring.wait_num == ring.wait_max)
+                {
+                    int n = ring.wait_max > 0 ? 2*ring.wait_max : MAX_TASKS;
+                    int *w = realloc(ring.waiting, n*sizeof(int));
+                    if(w == NULL)
+                    {
+                        perror("ring accept realloc");
+                        close(res);     /* the client is reset */
+                        break;
+                    }
+                    ring.waiting = w;
+                    ring.wait_max = n;
+                }
+                ring.waiting[ring.wait_num++] = res;
+            }
+            if(avaliable_list == -MAX_TASKS && ring.accepting && !ring.cancelled)
+            {
+                /* stop accepting, the rest are left in the backlog to other reactors */
+                struct io_uring_sqe *sqe = ring_sqe(IORING_OP_ASYNC_CANCEL, ring_data(RING_CANCEL, 0));
+                sqe->addr = ring_data(RING_ACCEPT, 0);
+                ring.cancelled = 1;
+            }
+            break;
+        case RING_RECV:
+            if(flags & IORING_CQE_F_BUFFER)
+            {
+                int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+                ring_client_recv(i, ring.bufs + bid*REQUESTBUF_SIZE, res);
+                ring_provide(bid, 1);
+            }
+            else        /* EOF or an error, no buffer is taken */
+                ring_client_recv(i, NULL, res > 0 ? -1 : res);
+            break;
+        case RING_SEND:
+            ring.reply_free[ring.reply_num++] = i;
+            if(res < 0 && res != -ECANCELED)
+                fprintf(stderr, "ring send: %s\n", strerror(-res));
+            break;
+        case RING_CLOSE:
+            if(res < 0)
+                fprintf(stderr, "ring close: %s\n", strerror(-res));
+            break;
+        case RING_PROVIDE:
+            if(res < 0)
+                fprintf(stderr, "ring provide: %s\n", strerror(-res));
+            break;
     }
-    else
+}
+/* reap the completions, the ring fd is readable */
+void ring_process(void)
+{
+    unsigned head = *ring.cq_head;
+
+    while(head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE))
     {
-        int l = client_readbuf(cl, &buf->buf[buf->len], REQUESTBUF_SIZE - buf->len);
-        if(l < 0)
+        struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        unsigned flags = cqe->flags;
+        __atomic_store_n(ring.cq_head, ++head, __ATOMIC_RELEASE);
+        ring_cqe(data, res, flags);
+    }
+}
+/* called every loop before waiting */
+void ring_prepare(void)
+{
+    int k;
+    for (k = 0; k < ring.wait_num && ring_client(ring.waiting[k]) == 0; ++k)
+        ;
+    ring.wait_num -= k;
+    memmove(ring.waiting, ring.waiting+k, ring.wait_num*sizeof(int));
+
+    if(!ring.accepting && avaliable_list != -MAX_TASKS)
+        ring_accept();
+    ring_submit();
+}
+
+void spawn_reply(int reactor, struct spawn_ev *ev)
+{
+    if(write(reactor_pipes[reactor][1], ev, sizeof *ev) != sizeof *ev)
+        perror("spawn_reply write");
+}
+/* the executable of a request for the child, -1 if it searches itself */
+int spawner_exe(const char buf[], int len)
+{
+    char name[EXE_NAME_MAX];
+    int n = request_cmd(buf, len, name, sizeof name);
+    if(n > 0 && n < sizeof name && builtin_find(name) < 0)
+        return exe_lookup(name);
+    return -1;
+}
+void spawn_record(pid_t pid, int owner, int leaf, int stage)
+{
+    int k;
+    for (k = 0; k < CHILD_MAX; ++k) {
+        if(spawn_pids[k] == 0)
         {
-            task_put(i);
+            spawn_pids[k] = pid;
+            spawn_owner[k] = owner;
+            spawn_leaf[k] = leaf;
+            spawn_stage[k] = stage;
             return;
         }
-        if(l == 0 && buf->len < REQUESTBUF_SIZE)
+    }
+    /* can't be, a reactor has MAX_TASKS at most */
+    fprintf(stderr, "too many children\n");
+}
+/*
+ * fork the stages of a pipeline, each reads the pipe written by the one
+ * before. the pool is not used, a helper can't join the group. the first is
+ * the leader of the group, return its pid and the stages started in started
+ */
+pid_t spawner_pipeline(struct spawn_req *rq, int leaf, int owner, int *started)
+{
+    char stage[REQUESTBUF_SIZE];
+    const char *first = memchr(rq->buf, DELIM, rq->len);
+    int pos = first - rq->buf, next, n, at, k;
+    int in = -1;
+    pid_t pgid = 0;
+
+    for (k = 0; (at = request_line(rq->buf, rq->len, &pos, &n)) >= 0 && k < STAGE_MAX; ++k) {
+        int io[2] = {in, -1}, p[2] = {-1, -1};
+        int len = request_line_copy(stage, rq->buf+at, n);
+
+        next = pos;
+        if(request_line(rq->buf, rq->len, &next, &n) >= 0)
+        {
+            if(pipe2(p, O_CLOEXEC) == -1)
+            {
+                perror("spawner_pipeline pipe2");
+                break;
+            }
+            io[1] = p[1];
+        }
+        else if(rq->flags & OPT_OUTPUT)
+            io[1] = rq->cl;
+
+        int exe = spawner_exe(stage, len);
+        pid_t pid = fork();
+        if(pid == 0)
         {
-            buf->buf[buf->len] = 0;
-            buf->len ++;
+            setpgid(0, pgid);
+            child_run(rq->cl, rq->type, stage, len, io, exe, leaf, k == 0 ? owner : -1);
         }
-        buf->len += l;
-        if(buf->buf[buf->len - 1] != 0)
+        if(pid < 0)
         {
-            return;
+            perror("spawner_pipeline fork");
+            if(p[0] >= 0)
+            {
+                close(p[0]);
+                close(p[1]);
+            }
+            break;
         }
-        return client_after_read(i, buf->buf, buf->len);
+        setpgid(pid, pgid);     /* also here, the next may join before it does */
+        if(pgid == 0)
+            pgid = pid;
+        spawn_record(pid, owner, leaf, k);
+        metric_add(spawned, 1);
+        if(in >= 0)
+            close(in);
+        if(p[1] >= 0)
+            close(p[1]);
+        in = p[0];
     }
+    if(in >= 0)
+        close(in);
+    if(at >= 0 && pgid > 0)     /* not run whole, the stages started get EOF or SIGPIPE */
+        kill(-pgid, SIGKILL);
+    *started = k;
+    return pgid > 0 ? pgid : -1;
 }
-
-void server_sock_process(int fd)
+/* a kill of a reactor, sent only while a child of the task is not reaped.
+   a request of the slot after the exit comes later on the pipe, so the
+   children of another task are never found here */
+void spawner_kill(struct spawn_req *rq)
 {
-    int i;
+    int owner = rq->reactor*MAX_TASKS + rq->i;
+    int k;
 
-    if((i = task_get()) < 0)
+    for (k = 0; k < CHILD_MAX; ++k) {
+        if(spawn_pids[k] != 0 && spawn_owner[k] == owner
+                && (rq->type == PPLNID || spawn_pids[k] == rq->pid))
+            break;
+    }
+    if(k == CHILD_MAX)
         return;
+    /* the group of a pipeline is kept while one of its stages is there */
+    if(kill(rq->type == PPLNID ? -rq->pid : rq->pid, rq->sig) < 0 && errno != ESRCH)
+        perror("spawner_kill");
+}
+/* fork or hand a request of a reactor to the pool */
+void spawner_spawn(struct spawn_req *rq)
+{
+    struct spawn_ev ev;
 
-    int cl = accept(fd, NULL, NULL);
-    if(cl < 0)
+    memset(&ev, 0, sizeof ev);
+    pid_t pid = -1;
+    int owner = rq->reactor*MAX_TASKS + rq->i;
+    int leaf = cg_leaf(rq->cls, owner);
+    exec_marks[owner] = 0;
+    spawn_t_fork[owner] = now_us();     /* before, the child may exec first */
+    if(leaf == -2)      /* not run out of its cgroup */
+        ;
+    else if(rq->type == PPLNID)
+        pid = spawner_pipeline(rq, leaf, owner, &ev.status);
+    else
     {
-        perror("accept");
-        task_put(i);
-        return;
+        int exe = spawner_exe(rq->buf, rq->len);
+        pid = pool_dispatch(rq->cl, rq->type, rq->buf, rq->len, rq->wr, exe, leaf, owner);
+        if(pid < 0)
+        {
+            pid = fork();
+            if(pid == 0)    /* child,  exec, no return */
+                child_run(rq->cl, rq->type, rq->buf, rq->len, rq->wr, exe, leaf, owner);
+        }
+        if(pid > 0)
+        {
+            spawn_record(pid, owner, leaf, -1);
+            metric_add(spawned, 1);
+        }
     }
-    task_socks[i] = cl;
+    if(rq->wr[0] >= 0)     /* the pipes of STRM or of PIPE cached */
+        close(rq->wr[0]);
+    if(rq->wr[1] >= 0)
+        close(rq->wr[1]);
 
-    int flags;
-    flags = fcntl(cl,F_GETFL,0);
-    if(flags == -1 || fcntl(cl, F_SETFL, flags | O_NONBLOCK) == -1)
+    ev.i = rq->i;
+    ev.pid = pid;
+    ev.what = SPAWN_OK;
+    if(pid < 0)
     {
-        perror("fcntl");
-        task_put(i);
-        return;
-    }
-
-    struct epoll_event ev;
-    ev.events = EPOLLIN | EPOLLET;
-    ev.data.fd = -i;    /* fd is saved in task_socks[i], use negative num to not conflict with normal fd */
-    if (epoll_ctl(epollfd, EPOLL_CTL_ADD, cl, &ev) == -1) {
-        perror("server_sock_process epoll_ctl");
-        task_put(i);
-        return;
+        perror("spawner_spawn fork");
+        ev.what = SPAWN_FAILED;
+        metric_add(spawn_failed, 1);
     }
+    else
+        hist_add(H_SPAWN, now_us() - rq->t_request);
+    spawn_reply(rq->reactor, &ev);
 }
 
 void sfd_process(int sfd)
@@ -440,10 +3690,42 @@ void sfd_process(int sfd)
     {
         int status;
         pid_t pid;
-        pid = waitpid(-1, &status, WNOHANG);
-        if(pid > 0)
+        struct rusage ru;
+        pid = wait4(-1, &status, WNOHANG, &ru);
+        if(pid > 0 && !pool_reaped(pid))
         {
-            after_wait(pid, status);
+            int k;
+            for (k = 0; k < CHILD_MAX && spawn_pids[k] != pid; ++k)
+                ;
+            if(k == CHILD_MAX)
+            {
+                fprintf(stderr, "pid %d not found\n", pid);
+                continue;
+            }
+            struct spawn_ev ev;
+            memset(&ev, 0, sizeof ev);
+            ev.what = SPAWN_EXITED;
+            ev.i = spawn_owner[k]%MAX_TASKS;
+            ev.pid = pid;
+            ev.status = status;
+            ev.stage = spawn_stage[k];
+            ev.ru = ru;
+            if(spawn_leaf[k] >= 0 && cg_oom_check(spawn_leaf[k]))
+            {
+                fprintf(stderr, "pid %d: oom killed in its cgroup\n", pid);
+                ev.status |= TASK_OOMKILLED;
+                metric_add(oomkilled, 1);
+            }
+            /* not set if it died before exec, only the first stage of a pipeline sets it */
+            long long t_exec = __atomic_load_n(&exec_marks[spawn_owner[k]], __ATOMIC_RELAXED);
+            if(spawn_stage[k] <= 0 && t_exec >= spawn_t_fork[spawn_owner[k]])
+            {
+                hist_add(H_EXEC, t_exec - spawn_t_fork[spawn_owner[k]]);
+                hist_add(H_RUN, now_us() - t_exec);
+            }
+            metric_add(exited, 1);
+            spawn_pids[k] = 0;
+            spawn_reply(spawn_owner[k]/MAX_TASKS, &ev);
         }
         else if(pid <= 0)
         {
@@ -454,88 +3736,92 @@ void sfd_process(int sfd)
     }
 }
 
-int main(int argc, char *argv[])
+void *reactor_main(void *arg)
 {
-    sigset_t mask;
-    int sfd;
-
-    sigemptyset(&mask);
-    sigaddset(&mask, SIGCHLD);
-
-    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
-        error_exist("sigprocmask");
-
-    sfd = signalfd(-1, &mask, 0);
-    if (sfd == -1)
-        error_exist("signalfd");
-
-
-    int server_sock;
-    struct sockaddr_un server_sockaddr;
-    char buf[256];
-    memset(&server_sockaddr, 0, sizeof(struct sockaddr_un));
-    memset(buf, 0, 256);                
-
-    server_sock = socket(AF_UNIX, SOCK_STREAM, 0);
-    if (server_sock == -1){
-        error_exist("socket");
-    }
-
-    server_sockaddr.sun_family = AF_UNIX;
-    unlink(SOCK_PATH);
-    strncpy(server_sockaddr.sun_path, SOCK_PATH, sizeof(server_sockaddr.sun_path)-1);
-    if(bind(server_sock, (struct sockaddr*)&server_sockaddr, sizeof(server_sockaddr)) == -1)
-        error_exist("bind");
-    if(listen(server_sock, BACKLOG) == -1)
-        error_exist("listen");
-
     struct epoll_event ev, events[MAX_EVENTS];
+    int event_fd;
 
-    epollfd = epoll_create1(0);
+    reactor_id = (intptr_t)arg;
+    event_fd = reactor_pipes[reactor_id][0];
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
     if(epollfd == -1)
         error_exist("epoll_create1");
 
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if(timer_fd == -1)
+        error_exist("timerfd_create");
     ev.events = EPOLLIN;
-    ev.data.fd = sfd;
-    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, sfd, &ev) == -1)
+    ev.data.fd = timer_fd;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, timer_fd, &ev) == -1)
         error_exist("epoll_ctl");
 
     ev.events = EPOLLIN;
-    ev.data.fd = server_sock;
-    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, server_sock, &ev) == -1)
+    ev.data.fd = event_fd;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, event_fd, &ev) == -1)
         error_exist("epoll_ctl");
 
+    if(use_uring)
+    {
+        if(ring_setup() < 0)
+            error_exist("ring_setup");
+        ring_provide(0, MAX_TASKS);
+        ev.events = EPOLLIN;
+        ev.data.fd = ring.fd;
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, ring.fd, &ev) == -1)
+            error_exist("epoll_ctl");
+    }
+    else
+    {
+        ev.events = EPOLLIN | EPOLLEXCLUSIVE;   /* one reactor is woken for a connection */
+        ev.data.fd = server_sock;
+        if(epoll_ctl(epollfd, EPOLL_CTL_ADD, server_sock, &ev) == -1)
+            error_exist("epoll_ctl");
+    }
+
     task_prepare();
 
     while(1)
     {
+        if(use_uring)
+            ring_prepare();
         int nfds = epoll_wait(epollfd, events, MAX_EVENTS, -1);
         if(nfds == -1)
         {
-            perror("epoll_wait");
-            sleep(1);
-            continue;
-        }
-        if(nfds == 1 && events[0].data.fd == server_sock && avaliable_list == -MAX_TASKS)
-        {
-            usleep(500000);
+            if(errno != EINTR)      /* the task work of io_uring interrupts it */
+            {
+                perror("epoll_wait");
+                sleep(1);
+            }
             continue;
         }
-
         int i;
         for (i = 0; i < nfds; ++i) {
-            if(events[i].data.fd == sfd)
-                sfd_process(sfd);
+            if(events[i].data.fd == event_fd)
+                spawn_event_process();
+            else if(use_uring && events[i].data.fd == ring.fd)
+                ring_process();
+            else if(events[i].data.fd == timer_fd)
+                timer_process();
             else if(events[i].data.fd == server_sock)
                 server_sock_process(server_sock);
             else
             {
                 int cl_i = -events[i].data.fd;
-                if(cl_i >= 0)
+                if(cl_i >= EV_OUTPUT*MAX_TASKS)
+                    client_writable(cl_i%MAX_TASKS, events[i].events);
+                else if(cl_i >= MAX_TASKS)   /* a pipe of STRM or of PIPE cached */
+                {
+                    if(task_types[cl_i%MAX_TASKS] == PIPEID)
+                        capture_pipe_process(cl_i%MAX_TASKS, events[i].events);
+                    else
+                        stream_pipe_process(cl_i%MAX_TASKS, cl_i/MAX_TASKS-EV_STDOUT, events[i].events);
+                }
+                else if(cl_i >= 0)
                 {
                     if(events[i].events & EPOLLERR)
                         task_put(cl_i);
-                    else if(task_pids[cl_i] <= 0) 
+                    else if(task_pids[cl_i] <= 0)
                         client_process(cl_i);
                 }
                 else
@@ -543,6 +3829,199 @@ int main(int argc, char *argv[])
 
             }
         }
+        batch_run();
+        sched_run();
+    }
+    return NULL;
+}
+
+/* the main thread, see struct spawn_req */
+void spawner_main(int sfd)
+{
+    struct epoll_event ev, events[2];
+    struct spawn_req rq;
+
+    int efd = epoll_create1(EPOLL_CLOEXEC);
+    if(efd == -1)
+        error_exist("epoll_create1");
+
+    ev.events = EPOLLIN;
+    ev.data.fd = sfd;
+    if(epoll_ctl(efd, EPOLL_CTL_ADD, sfd, &ev) == -1)
+        error_exist("epoll_ctl");
+
+    ev.events = EPOLLIN;
+    ev.data.fd = spawner_pipe[0];
+    if(epoll_ctl(efd, EPOLL_CTL_ADD, spawner_pipe[0], &ev) == -1)
+        error_exist("epoll_ctl");
+
+    while(1)
+    {
+        pool_refill();
+        int nfds = epoll_wait(efd, events, 2, pool_max > 0 ? POOL_PERIOD_MS : -1);
+        if(nfds == -1)
+        {
+            if(errno != EINTR)
+            {
+                perror("epoll_wait");
+                sleep(1);
+            }
+            continue;
+        }
+
+        int i;
+        for (i = 0; i < nfds; ++i) {
+            if(events[i].data.fd == sfd)
+                sfd_process(sfd);
+            else
+            {
+                while(read(spawner_pipe[0], &rq, sizeof rq) == sizeof rq)
+                {
+                    if(rq.sig != 0)
+                        spawner_kill(&rq);
+                    else
+                        spawner_spawn(&rq);
+                }
+            }
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    sigset_t mask;
+    int sfd;
+    int opt;
+
+    exe_prepare();
+    cache_prepare();
+    reactor_num = sysconf(_SC_NPROCESSORS_ONLN);
+    while((opt = getopt(argc, argv, "p:a:t:j:q:r:ueg:l:m:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'u':
+                use_uring = 1;
+                break;
+            case 'e':
+                use_uring = 0;
+                break;
+            case 'r':
+                reactor_num = atoi(optarg);
+                break;
+            case 'j':
+                run_max = atoi(optarg);
+                break;
+            case 'q':
+                if(sscanf(optarg, "%d,%d,%d", &class_cap[0], &class_cap[1], &class_cap[2]) != CLASS_NUM)
+                    error_exist("-q");
+                break;
+            case 't':
+                default_timeout_ms = atoi(optarg);
+                break;
+            case 'a':
+                if(allow_load(optarg) < 0)
+                    error_exist("allowlist");
+                break;
+            case 'g':
+                if(strlen(optarg) >= sizeof cg_base)
+                    error_exist("-g");
+                strcpy(cg_base, optarg);
+                break;
+            case 'l':
+                if(cg_limit_parse(optarg) < 0)
+                {
+                    fprintf(stderr, "-l %s: not class:file=value\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'm':
+                cache_max = atoll(optarg) << 20;
+                break;
+            case 'p':
+                pool_max = atoi(optarg);
+                if(pool_max > POOL_LIMIT)
+                    pool_max = POOL_LIMIT;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-r reactors] [-u|-e] [-p pool_size] [-a allowlist] [-t timeout_ms]"
+                        " [-j max_running] [-q cap0,cap1,cap2] [-g cgroup_dir [-l class:file=value]...] [-m cache_mb]\n"
+                        "  -u io_uring, -e epoll for the sockets of clients\n"
+                        "  -j and -q are of a reactor\n"
+                        "  -g runs the tasks in cgroup v2 groups of the classes, limited by -l\n"
+                        "  -m the output cached at most for c=, 0 for no cache\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(cg_limit_num > 0 && cg_base[0] == 0)
+    {
+        fprintf(stderr, "-l needs -g\n");
+        exit(EXIT_FAILURE);
+    }
+    if(cg_base[0])
+        cg_prepare();
+    /* shared with the children, forked or of the pool */
+    exec_marks = mmap(NULL, SPAWN_MAX*sizeof(long long), PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0);
+    if(exec_marks == MAP_FAILED)
+        error_exist("mmap");
+    if(reactor_num < 1)
+        reactor_num = 1;
+    if(reactor_num > REACTOR_MAX)
+        reactor_num = REACTOR_MAX;
+
+    /* blocked before the threads are created, so in all of them */
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+
+    if (sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+        error_exist("sigprocmask");
+
+    sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+    if (sfd == -1)
+        error_exist("signalfd");
+    signal(SIGPIPE, SIG_IGN);
+
+
+    struct sockaddr_un server_sockaddr;
+    memset(&server_sockaddr, 0, sizeof(struct sockaddr_un));
+
+    /* blocking for io_uring, or the accept of the ring fails with EAGAIN */
+    server_sock = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC|(use_uring ? 0 : SOCK_NONBLOCK), 0);
+    if (server_sock == -1){
+        error_exist("socket");
+    }
+
+    server_sockaddr.sun_family = AF_UNIX;
+    unlink(SOCK_PATH);
+    strncpy(server_sockaddr.sun_path, SOCK_PATH, sizeof(server_sockaddr.sun_path)-1);
+    if(bind(server_sock, (struct sockaddr*)&server_sockaddr, sizeof(server_sockaddr)) == -1)
+        error_exist("bind");
+    if(listen(server_sock, BACKLOG) == -1)
+        error_exist("listen");
+
+    if(use_uring && ring_probe() < 0)   /* fall back to epoll if the kernel has not all of io_uring */
+    {
+        perror("io_uring not supported, use epoll");
+        use_uring = 0;
+        fcntl(server_sock, F_SETFL, O_NONBLOCK);
     }
+
+    /* the read ends are nonblocking to read until empty, the write ends block */
+    if(pipe2(spawner_pipe, O_CLOEXEC) == -1)
+        error_exist("pipe2");
+    fcntl(spawner_pipe[0], F_SETFL, O_NONBLOCK);
+
+    int r;
+    for (r = 0; r < reactor_num; ++r) {
+        pthread_t tid;
+        if(pipe2(reactor_pipes[r], O_CLOEXEC) == -1)
+            error_exist("pipe2");
+        fcntl(reactor_pipes[r][0], F_SETFL, O_NONBLOCK);
+        if((errno = pthread_create(&tid, NULL, reactor_main, (void *)(intptr_t)r)) != 0)
+            error_exist("pthread_create");
+        pthread_detach(tid);
+    }
+
+    spawner_main(sfd);
     return 0;
 }
@@ -0,0 +1,460 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+
+/*
+ * BSD License
+ * build: cc -O2 -o task_proxy_bench task_proxy_bench.c
+ * a load generator of task_proxy, see the protocol in task_proxy.c
+ * it keeps -c connections at most on one epoll, each runs one request:
+ *   closed loop (default), a new request starts as soon as one is done
+ *   open loop (-R rate), requests start at a fixed rate, the latency is
+ *   taken from the time a request should have started, so a proxy too slow
+ *   to keep up is seen in the latency and not hidden by the generator
+ * the mix is given by -m like "exec=50,pipe=30,nret=20" and the tasks are
+ * trivial: exec and nret run true, pipe runs cat of a file in /proc
+ * for example:
+ * task_proxy_bench -c 32 -d 10
+ * task_proxy_bench -c 256 -R 2000 -d 10 -m exec=80,pipe=20
+ * a connect that finds the backlog of the proxy full is counted as full, not
+ * as an error, and the requests wait a while before they are started again
+ **/
+#define SOCK_PATH   "/tmp/task_proxy"
+#define RETURN_MARK "####"
+#define CONN_MAX    4096
+#define MAX_EVENTS  256
+#define REPLY_MAX   64      /* kept of a reply, the output of pipe is only counted */
+#define BACKOFF_MIN_US  1000    /* the wait after the backlog is full, doubled each time */
+#define BACKOFF_MAX_US  64000
+
+#define HIST_SUB_BITS   3
+#define HIST_SUB        (1<<HIST_SUB_BITS)
+#define HIST_MAX_BITS   40
+#define HIST_BUCKETS    ((HIST_MAX_BITS-HIST_SUB_BITS+1)*HIST_SUB)
+
+#define error_exist(msg ) do { perror(msg); exit(EXIT_FAILURE); } while (0)
+
+enum
+{
+    EXECID,
+    PIPEID,
+    NRETID,
+    TYPE_NUM,
+};
+const char *type_names[TYPE_NUM] = {"exec", "pipe", "nret"};
+const char *requests[TYPE_NUM] =
+{
+    "exec#true",
+    "pipe#cat#/proc/version",
+    "nret#true",
+};
+int weights[TYPE_NUM] = {100, 0, 0};
+
+struct hist
+{
+    unsigned long long count, sum, max;
+    unsigned long long buckets[HIST_BUCKETS];
+};
+struct result
+{
+    unsigned long long ok;
+    unsigned long long failed;      /* a status not 0 */
+    unsigned long long errors;      /* connect, io or a broken reply */
+    unsigned long long full;        /* the backlog was full, started again later */
+    unsigned long long bytes;
+    struct hist hist;
+} results[TYPE_NUM];
+
+/* a connection running one request, free if fd < 0 */
+struct conn
+{
+    int fd;
+    int type;
+    long long start;        /* us, when it should have started */
+    int len;
+    char reply[REPLY_MAX];
+} conns[CONN_MAX];
+int conn_free[CONN_MAX];
+int conn_free_num;
+int inflight;
+
+char *sock_path = SOCK_PATH;
+int epollfd;
+long long backoff_until;    /* us, no connect before */
+int backoff_us = BACKOFF_MIN_US;
+
+long long now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec*1000000LL + ts.tv_nsec/1000;
+}
+int hist_index(unsigned long long v)
+{
+    if(v < HIST_SUB)
+        return v;
+    int shift = 63 - __builtin_clzll(v) - HIST_SUB_BITS;
+    if(shift + HIST_SUB_BITS >= HIST_MAX_BITS)
+        return HIST_BUCKETS-1;
+    return (shift+1)*HIST_SUB + (v >> shift) - HIST_SUB;
+}
+unsigned long long hist_bound(int k)
+{
+    if(k < HIST_SUB)
+        return k;
+    int shift = k/HIST_SUB - 1;
+    return ((unsigned long long)(HIST_SUB + k%HIST_SUB + 1) << shift) - 1;
+}
+void hist_add(struct hist *h, long long v)
+{
+    if(v < 0)
+        v = 0;
+    h->buckets[hist_index(v)]++;
+    h->count++;
+    h->sum += v;
+    if(v > h->max)
+        h->max = v;
+}
+void hist_merge(struct hist *to, const struct hist *from)
+{
+    int k;
+    for (k = 0; k < HIST_BUCKETS; ++k)
+        to->buckets[k] += from->buckets[k];
+    to->count += from->count;
+    to->sum += from->sum;
+    if(from->max > to->max)
+        to->max = from->max;
+}
+/* q of 1000, like 999 for p99.9. the bound of a bucket may be over what was seen */
+unsigned long long hist_percentile(const struct hist *h, int q)
+{
+    unsigned long long rank = h->count*q/1000, seen = 0;
+    int k;
+    for (k = 0; k < HIST_BUCKETS; ++k) {
+        seen += h->buckets[k];
+        if(seen > rank)
+            return hist_bound(k) < h->max ? hist_bound(k) : h->max;
+    }
+    return 0;
+}
+
+/* "exec=50,pipe=30,nret=20" */
+int parse_mix(char *arg)
+{
+    int k, total = 0;
+    char *item;
+
+    for (k = 0; k < TYPE_NUM; ++k)
+        weights[k] = 0;
+    for (item = strtok(arg, ","); item != NULL; item = strtok(NULL, ",")) {
+        for (k = 0; k < TYPE_NUM; ++k) {
+            int n = strlen(type_names[k]);
+            if(strncmp(item, type_names[k], n) == 0 && item[n] == '=')
+            {
+                weights[k] = atoi(item+n+1);
+                break;
+            }
+        }
+        if(k == TYPE_NUM || weights[k] < 0)
+            return -1;
+    }
+    for (k = 0; k < TYPE_NUM; ++k)
+        total += weights[k];
+    return total > 0 ? 0 : -1;
+}
+int pick_type(void)
+{
+    int k, total = 0;
+    for (k = 0; k < TYPE_NUM; ++k)
+        total += weights[k];
+    int r = rand()%total;
+    for (k = 0; r >= weights[k]; ++k)
+        r -= weights[k];
+    return k;
+}
+
+void conn_done(struct conn *c, int error)
+{
+    struct result *res = &results[c->type];
+
+    epoll_ctl(epollfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    conn_free[conn_free_num++] = c - conns;
+    inflight--;
+
+    if(!error && c->type == EXECID)     /* the status must be there and be 0 */
+    {
+        int32_t status;
+        if(c->len != sizeof RETURN_MARK -1 + sizeof status || memcmp(c->reply, RETURN_MARK, sizeof RETURN_MARK -1) != 0)
+            error = 1;
+        else
+        {
+            memcpy(&status, c->reply + sizeof RETURN_MARK -1, sizeof status);
+            if(status != 0)
+            {
+                res->failed++;
+                return;
+            }
+        }
+    }
+    if(error)
+    {
+        res->errors++;
+        return;
+    }
+    res->ok++;
+    hist_add(&res->hist, now_us() - c->start);
+}
+/* the proxy can't take more connections now, let it work a while */
+void backoff(void)
+{
+    backoff_until = now_us() + backoff_us;
+    if(backoff_us < BACKOFF_MAX_US)
+        backoff_us *= 2;
+}
+/* connect and send the request, the proxy reads it in one go.
+   return -2 if the backlog is full, the request is not started.
+   one that can't connect is an error and backs off too */
+int conn_start(long long start)
+{
+    struct sockaddr_un addr;
+    int type = pick_type();
+    const char *req = requests[type];
+
+    if(conn_free_num == 0)
+        return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC, 0);
+    if(fd < 0)
+        error_exist("socket");
+    memset(&addr, 0, sizeof addr);
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, sock_path, sizeof addr.sun_path -1);
+    int ret = connect(fd, (struct sockaddr *)&addr, sizeof addr);
+    if(ret == -1 && errno == EAGAIN)    /* a full backlog of a unix socket */
+    {
+        results[type].full++;
+        close(fd);
+        return -2;
+    }
+
+    struct conn *c = &conns[conn_free[--conn_free_num]];
+    c->fd = fd;
+    c->type = type;
+    c->start = start;
+    c->len = 0;
+    inflight++;
+    if(ret == -1 || write(c->fd, req, strlen(req)+1) != strlen(req)+1)
+    {
+        if(ret == -1)   /* no proxy there, not retried at once */
+            backoff();
+        conn_done(c, 1);
+        return 0;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if(epoll_ctl(epollfd, EPOLL_CTL_ADD, c->fd, &ev) == -1)
+        error_exist("epoll_ctl");
+    backoff_us = BACKOFF_MIN_US;
+    return 0;
+}
+/* all replies end with EOF, EXEC has the status before it */
+void conn_process(struct conn *c)
+{
+    char buf[65536];
+
+    while(1)
+    {
+        ssize_t n = read(c->fd, buf, sizeof buf);
+        if(n < 0)
+        {
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            if(errno == EINTR)
+                continue;
+            conn_done(c, 1);
+            return;
+        }
+        if(n == 0)
+        {
+            conn_done(c, 0);
+            return;
+        }
+        results[c->type].bytes += n;
+        if(c->len + n <= REPLY_MAX)
+            memcpy(c->reply + c->len, buf, n);
+        c->len += n;
+    }
+}
+
+void report(double seconds)
+{
+    struct result all;
+    int k, t;
+    static const int qs[] = {500, 990, 999};
+
+    memset(&all, 0, sizeof all);
+    printf("%-6s %10s %8s %8s %8s %10s %8s %8s %8s %8s %8s\n",
+            "type", "ok", "failed", "errors", "full", "req/s", "mean", "p50", "p99", "p999", "max");
+    for (t = 0; t <= TYPE_NUM; ++t) {
+        struct result *r = &all;
+        if(t < TYPE_NUM)
+        {
+            r = &results[t];
+            if(weights[t] == 0)
+                continue;
+            all.ok += r->ok;
+            all.failed += r->failed;
+            all.errors += r->errors;
+            all.full += r->full;
+            all.bytes += r->bytes;
+            hist_merge(&all.hist, &r->hist);
+        }
+        printf("%-6s %10llu %8llu %8llu %8llu %10.0f %8llu", t < TYPE_NUM ? type_names[t] : "all",
+                r->ok, r->failed, r->errors, r->full, r->ok/seconds, r->hist.count ? r->hist.sum/r->hist.count : 0);
+        for (k = 0; k < sizeof qs/sizeof qs[0]; ++k)
+            printf(" %8llu", hist_percentile(&r->hist, qs[k]));
+        printf(" %8llu\n", r->hist.max);
+    }
+    printf("latencies in us, %.2f s, %llu bytes of replies\n", seconds, all.bytes);
+}
+
+int main(int argc, char *argv[])
+{
+    struct epoll_event events[MAX_EVENTS];
+    int concurrency = 16;
+    long long total = 0;        /* requests, 0 if by duration */
+    double duration = 5;
+    double rate = 0;            /* per second, 0 for the closed loop */
+    int opt, k;
+
+    while((opt = getopt(argc, argv, "c:n:d:R:m:s:")) != -1)
+    {
+        switch(opt)
+        {
+            case 'c':
+                concurrency = atoi(optarg);
+                break;
+            case 'n':
+                total = atoll(optarg);
+                break;
+            case 'd':
+                duration = atof(optarg);
+                break;
+            case 'R':
+                rate = atof(optarg);
+                break;
+            case 'm':
+                if(parse_mix(optarg) < 0)
+                {
+                    fprintf(stderr, "-m like exec=50,pipe=30,nret=20\n");
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 's':
+                sock_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-c connections] [-n requests | -d seconds] [-R rate]"
+                        " [-m exec=n,pipe=n,nret=n] [-s socket]\n"
+                        "  -R starts requests at a fixed rate, or one starts when one is done\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+    if(concurrency < 1)
+        concurrency = 1;
+    if(concurrency > CONN_MAX)
+        concurrency = CONN_MAX;
+    for (k = 0; k < concurrency; ++k) {
+        conns[k].fd = -1;
+        conn_free[conn_free_num++] = concurrency-1-k;
+    }
+
+    epollfd = epoll_create1(EPOLL_CLOEXEC);
+    if(epollfd == -1)
+        error_exist("epoll_create1");
+    srand(getpid());
+
+    long long begin = now_us();
+    long long end = begin + (long long)(duration*1000000);
+    long long started = 0, late = 0;
+    long long next = begin;     /* when the next request should start, open loop */
+    long long interval = rate > 0 ? (long long)(1000000/rate) : 0;
+
+    while(1)
+    {
+        long long now = now_us();
+        int more = total > 0 ? started < total : now < end;
+
+        if(more && now < backoff_until)
+            ;
+        else if(more && rate <= 0)
+        {
+            while(inflight < concurrency && (total == 0 ? now_us() < end : started < total)
+                    && now_us() >= backoff_until)
+            {
+                if(conn_start(now_us()) == -2)
+                {
+                    backoff();
+                    break;
+                }
+                started++;
+            }
+        }
+        else if(more)
+        {
+            /* behind the schedule if all connections are busy, start them late.
+               one not started for a full backlog is started again, also late */
+            while(next <= now && (total == 0 || started < total) && inflight < concurrency
+                    && now_us() >= backoff_until)
+            {
+                if(conn_start(next) == -2)
+                {
+                    backoff();
+                    break;
+                }
+                if(now - next > interval)
+                    late++;
+                started++;
+                next += interval;
+            }
+        }
+        /* the starts may all have failed right away, nothing would wake us */
+        more = total > 0 ? started < total : now < end;
+        if(!more && inflight == 0)
+            break;
+
+        int timeout = -1;
+        if(more && backoff_until > now_us())   /* the replies may come before */
+            timeout = (backoff_until-now_us()+999)/1000;
+        else if(more && rate > 0)
+            timeout = next > now ? (next-now+999)/1000 : (inflight < concurrency ? 0 : -1);
+        else if(more && total == 0)
+            timeout = (end-now+999)/1000;
+        int nfds = epoll_wait(epollfd, events, MAX_EVENTS, timeout);
+        if(nfds == -1)
+        {
+            if(errno == EINTR)
+                continue;
+            error_exist("epoll_wait");
+        }
+        for (k = 0; k < nfds; ++k)
+            conn_process(events[k].data.ptr);
+    }
+
+    report((now_us() - begin)/1e6);
+    if(rate > 0)
+        printf("%lld started late, all %d connections were busy\n", late, concurrency);
+    return 0;
+}